@@ -1,68 +1,2755 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // fallocate, O_DIRECT, vmsplice
+#endif
+
 #include "bmflat.h"
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define STB_VORBIS_HEADER_ONLY
+#include "stb_vorbis.c"
+#define MINIAUDIO_IMPLEMENTATION
+#include "miniaudio.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+#if (defined(MA_X64) || defined(MA_X86)) && !defined(MA_NO_CPUID) && !defined(MA_NO_XGETBV)
+#include <immintrin.h>
+#define MIX_AVX2
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+#endif
+
+static const char *img_exts[] = {
+  ".bmp", ".png", ".jpg", ".jpeg", ".gif",
+  ".BMP", ".PNG", ".JPG", ".JPEG", ".GIF"
+};
+
+char *read_file(const char *path, size_t *size)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+  char *buf = NULL;
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (len > 0) {
+    buf = malloc(len + 1);
+    if (buf) {
+      fread(buf, len, 1, f);
+      buf[len] = 0;
+    }
+  }
+  fclose(f);
+  if (size) *size = len > 0 ? (size_t)len : 0;
+  return buf;
+}
+
+char *strdupcat(const char *a, const char *b)
+{
+  if (!a) return strdup(b);
+  size_t la = strlen(a), lb = strlen(b);
+  char *r = malloc(la + lb + 1);
+  memcpy(r, a, la);
+  memcpy(r + la, b, lb);
+  r[la + lb] = 0;
+  return r;
+}
+
+char *strdupcat3(const char *a, const char *b, const char *c)
+{
+  size_t la = a ? strlen(a) : 0;
+  size_t lb = strlen(b);
+  size_t lc = strlen(c);
+  char *r = malloc(la + lb + lc + 1);
+  if (a) memcpy(r, a, la);
+  memcpy(r + la, b, lb);
+  memcpy(r + la + lb, c, lc);
+  r[la + lb + lc] = 0;
+  return r;
+}
+
+// Only frames [head, head + span) are stored; the rest of len is silence
+struct wave {
+  int16_t *pcm; int len, ch;
+  int head, span, level;
+  // With --adpcm the span is held as IMA-ADPCM blocks and pcm is NULL;
+  // `counted` is set once its size and coding error are in the totals
+  uint8_t *adpcm;
+  int counted;
+  // Bank mode: compressed source kept resident, PCM decoded on demand
+  uint8_t *src; size_t src_size;
+  int refs;
+  struct wave *lru_prev, *lru_next;
+};
+
+// A playing instance of a wave; the same wave may have several voices.
+// It sounds until frame `stop` of the wave, earlier if it was cut.
+struct voice { struct wave *w; int ptr, stop, bus; struct take *take; };
+
+// Where one triggered voice starts on the output clock and how long it
+// ends up sounding once voice limit cuts are applied
+struct take { struct wave *w; long long start; int stop, bus; };
+
+// Which live voice is cut when a trigger finds `cap` voices sounding:
+// the oldest, the one with the lowest peak level, or the oldest voice of
+// the same keysound (falling back to the oldest voice)
+enum steal_policy { STEAL_OLDEST, STEAL_QUIETEST, STEAL_SAME };
+
+static const char *steal_names[] = { "oldest", "quietest", "same" };
+
+// Voices in trigger order, oldest first; cut voices stay in the list
+// until the block they end in has been mixed, so the list may briefly
+// hold more than `cap` entries
+struct voices {
+  struct voice *v;
+  int count, size, cap, peak;
+  enum steal_policy policy;
+  long started, stolen, stolen_same;
+};
+
+// Bounded cache of decoded keysounds; only waves not currently playing
+// sit in the LRU list and may be evicted
+struct bank {
+  int enabled, adpcm;
+  // Peak levels are needed before decoding (--steal quietest)
+  int levels;
+  int ch, sr;
+  size_t cap, used, peak;
+  struct wave *lru_head, *lru_tail;
+  long hits, misses, evictions;
+  // ADPCM quality against the s16 source: summed energies, worst keysound
+  double signal, noise, worst_snr;
+  size_t pcm_bytes, packed_bytes;
+};
+
+// Drops digital silence at both ends so the mixer never adds zero frames
+void trim_wave(struct wave *w)
+{
+  int n = w->len * w->ch;
+  int first = 0, last = n;
+  while (first < n && w->pcm[first] == 0) first++;
+  while (last > first && w->pcm[last - 1] == 0) last--;
+  w->head = first / w->ch;
+  w->span = (last + w->ch - 1) / w->ch - w->head;
+  w->level = 0;
+  for (int k = first; k < last; k++) {
+    int a = w->pcm[k] < 0 ? -w->pcm[k] : w->pcm[k];
+    if (a > w->level) w->level = a;
+  }
+  if (w->span == w->len) return;
+
+  memmove(w->pcm, w->pcm + (size_t)w->head * w->ch,
+    (size_t)w->span * w->ch * sizeof(int16_t));
+  size_t keep = (size_t)(w->span ? w->span : 1) * w->ch * sizeof(int16_t);
+  int16_t *pcm = ma_realloc(w->pcm, keep, NULL);
+  if (pcm) w->pcm = pcm;
+}
+
+// Resident IMA-ADPCM: the stored span is cut into blocks of ADPCM_BLOCK
+// frames that decode on their own, so a voice may start anywhere. Per
+// channel a block holds its exact first sample, the step index and 4-bit
+// codes for the other frames, a little under a quarter of the s16 size.
+#define ADPCM_BLOCK 256
+#define ADPCM_CH_BYTES (4 + ADPCM_BLOCK / 2)
+
+static const int16_t ima_steps[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41,
+  45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190,
+  209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724,
+  796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272,
+  2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132,
+  7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500,
+  20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t ima_index[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+struct ima { int pred, index; };
+
+int ima_decode(struct ima *s, int code)
+{
+  int diff = ima_steps[s->index] * (2 * (code & 7) + 1) >> 3;
+  s->pred += code & 8 ? -diff : diff;
+  if (s->pred > INT16_MAX) s->pred = INT16_MAX;
+  if (s->pred < INT16_MIN) s->pred = INT16_MIN;
+  s->index += ima_index[code];
+  if (s->index < 0) s->index = 0;
+  if (s->index > 88) s->index = 88;
+  return s->pred;
+}
+
+// Picks the code whose reconstruction lands nearest to `x`
+int ima_encode(struct ima *s, int x)
+{
+  int step = ima_steps[s->index];
+  int d = x - s->pred, code = 0;
+  if (d < 0) { code = 8; d = -d; }
+  int q = 4 * d / step;
+  if (q > 7) q = 7;
+  code |= q;
+  ima_decode(s, code);
+  return code;
+}
+
+int adpcm_blocks(const struct wave *w)
+{
+  return (w->span + ADPCM_BLOCK - 1) / ADPCM_BLOCK;
+}
+
+// Decodes frames [from, to) of block `b` as interleaved s16
+void adpcm_decode(const struct wave *w, int b, int from, int to, int16_t *pcm)
+{
+  // Channels are stepped together so their dependency chains overlap
+  const uint8_t *p[2];
+  struct ima s[2];
+  int ch = w->ch;
+  for (int c = 0; c < ch; c++) {
+    p[c] = w->adpcm + ((size_t)b * ch + c) * ADPCM_CH_BYTES;
+    s[c].pred = (int16_t)(p[c][0] | p[c][1] << 8);
+    s[c].index = p[c][2];
+    if (from == 0) pcm[c] = (int16_t)s[c].pred;
+  }
+  pcm -= (size_t)from * ch;
+  int j = 1;
+  for (; j < from; j++)
+    for (int c = 0; c < ch; c++)
+      ima_decode(&s[c], p[c][4 + (j - 1) / 2] >> ((j - 1) & 1) * 4 & 15);
+  for (; j < to; j++)
+    for (int c = 0; c < ch; c++)
+      pcm[j * ch + c] = (int16_t)ima_decode(&s[c],
+        p[c][4 + (j - 1) / 2] >> ((j - 1) & 1) * 4 & 15);
+}
+
+// Replaces the s16 span of a wave with ADPCM blocks and, the first time
+// it is packed, records the coding error against it
+void adpcm_pack(struct bank *bank, struct wave *w)
+{
+  if (w->span == 0 || w->ch > 2) return;
+  int blocks = adpcm_blocks(w);
+  w->adpcm = calloc((size_t)blocks * w->ch, ADPCM_CH_BYTES);
+  int index[2] = {0};
+  for (int b = 0; b < blocks; b++) {
+    int n = w->span - b * ADPCM_BLOCK;
+    if (n > ADPCM_BLOCK) n = ADPCM_BLOCK;
+    for (int c = 0; c < w->ch; c++) {
+      const int16_t *x = w->pcm + (size_t)b * ADPCM_BLOCK * w->ch + c;
+      uint8_t *p = w->adpcm + ((size_t)b * w->ch + c) * ADPCM_CH_BYTES;
+      struct ima s = { x[0], index[c] };
+      p[0] = x[0] & 0xff;
+      p[1] = (x[0] >> 8) & 0xff;
+      p[2] = (uint8_t)s.index;
+      for (int j = 1; j < n; j++)
+        p[4 + (j - 1) / 2] |= ima_encode(&s, x[j * w->ch]) << ((j - 1) & 1) * 4;
+      index[c] = s.index;
+    }
+  }
+  // Bank mode packs a wave again each time it is decoded after eviction
+  if (w->counted) {
+    ma_free(w->pcm, NULL);
+    w->pcm = NULL;
+    return;
+  }
+  w->counted = 1;
+
+  double signal = 0.0, noise = 0.0;
+  int16_t tmp[ADPCM_BLOCK * 2];
+  for (int b = 0; b < blocks; b++) {
+    int n = w->span - b * ADPCM_BLOCK;
+    if (n > ADPCM_BLOCK) n = ADPCM_BLOCK;
+    adpcm_decode(w, b, 0, n, tmp);
+    const int16_t *x = w->pcm + (size_t)b * ADPCM_BLOCK * w->ch;
+    for (int k = 0; k < n * w->ch; k++) {
+      double d = x[k] - tmp[k];
+      signal += (double)x[k] * x[k];
+      noise += d * d;
+    }
+  }
+  bank->signal += signal;
+  bank->noise += noise;
+  if (noise > 0.0) {
+    double snr = 10.0 * log10(signal / noise);
+    if (snr < bank->worst_snr) bank->worst_snr = snr;
+  }
+  bank->pcm_bytes += (size_t)w->span * w->ch * sizeof(int16_t);
+  bank->packed_bytes += (size_t)blocks * w->ch * ADPCM_CH_BYTES;
+  ma_free(w->pcm, NULL);
+  w->pcm = NULL;
+}
+
+// Mono sources stay mono and are upmixed by mix_wave()
+int decode_wave(const void *data, size_t size, int ch, int sr, struct wave *w)
+{
+  ma_decoder_config cfg = ma_decoder_config_init(ma_format_s16, 0, sr);
+  ma_decoder dec;
+  if (ma_decoder_init_memory(data, size, &cfg, &dec) != MA_SUCCESS) return 0;
+  int src_ch = (int)dec.outputChannels;
+  ma_decoder_uninit(&dec);
+
+  cfg.channels = (src_ch == 1 ? 1 : ch);
+  ma_uint64 len;
+  if (ma_decode_memory(data, size, &cfg, &len, (void**)&w->pcm) != MA_SUCCESS) return 0;
+  w->len = (int)len;
+  w->ch = (int)cfg.channels;
+  trim_wave(w);
+  return 1;
+}
+
+int load_wave(const char *path, struct bank *bank, struct wave *w)
+{
+  size_t size;
+  uint8_t *data = (uint8_t *)read_file(path, &size);
+  if (!data) return 0;
+
+  if (bank->enabled) {
+    ma_decoder_config cfg = ma_decoder_config_init(ma_format_s16, 0, bank->sr);
+    ma_decoder dec;
+    if (ma_decoder_init_memory(data, size, &cfg, &dec) != MA_SUCCESS) {
+      free(data);
+      return 0;
+    }
+    // The PCM is decoded on first use; the length is known up front so
+    // output sizes can be planned before rendering
+    ma_uint64 len = 0;
+    ma_decoder_get_length_in_pcm_frames(&dec, &len);
+    ma_decoder_uninit(&dec);
+    w->len = (int)len;
+    w->src = data;
+    w->src_size = size;
+    if (bank->levels) {
+      // Planned cuts pick victims by level, so it has to match what the
+      // decode on trigger will find
+      struct wave probe = {0};
+      if (decode_wave(data, size, bank->ch, bank->sr, &probe)) {
+        w->level = probe.level;
+        ma_free(probe.pcm, NULL);
+      }
+    }
+    return 1;
+  }
+
+  int ok = decode_wave(data, size, bank->ch, bank->sr, w);
+  if (ok && bank->adpcm) adpcm_pack(bank, w);
+  free(data);
+  return ok;
+}
+
+size_t wave_bytes(const struct wave *w)
+{
+  if (w->adpcm) return (size_t)adpcm_blocks(w) * w->ch * ADPCM_CH_BYTES;
+  return (size_t)w->span * w->ch * sizeof(int16_t);
+}
+
+int wave_resident(const struct wave *w)
+{
+  return w->pcm || w->adpcm;
+}
+
+void bank_unlink(struct bank *bank, struct wave *w)
+{
+  if (w->lru_prev) w->lru_prev->lru_next = w->lru_next;
+  else bank->lru_head = w->lru_next;
+  if (w->lru_next) w->lru_next->lru_prev = w->lru_prev;
+  else bank->lru_tail = w->lru_prev;
+  w->lru_prev = w->lru_next = NULL;
+}
+
+void bank_evict(struct bank *bank)
+{
+  while (bank->used > bank->cap && bank->lru_tail) {
+    struct wave *w = bank->lru_tail;
+    bank_unlink(bank, w);
+    bank->used -= wave_bytes(w);
+    ma_free(w->pcm, NULL);
+    free(w->adpcm);
+    w->pcm = NULL;
+    w->adpcm = NULL;
+    w->span = 0;
+    bank->evictions++;
+  }
+}
+
+// Makes the PCM of a wave resident and pins it while it plays
+void bank_acquire(struct bank *bank, struct wave *w)
+{
+  if (!bank->enabled || !w->src) return;
+  if (w->refs++ > 0) {
+    bank->hits++;
+    return;
+  }
+  if (wave_resident(w)) {
+    bank_unlink(bank, w);
+    bank->hits++;
+    return;
+  }
+  bank->misses++;
+  if (!decode_wave(w->src, w->src_size, bank->ch, bank->sr, w)) {
+    w->pcm = NULL;
+    w->len = w->span = 0;
+    return;
+  }
+  if (bank->adpcm) adpcm_pack(bank, w);
+  bank->used += wave_bytes(w);
+  bank_evict(bank);
+  if (bank->peak < bank->used) bank->peak = bank->used;
+}
+
+void bank_release(struct bank *bank, struct wave *w)
+{
+  if (!bank->enabled || !w->src || --w->refs > 0 || !wave_resident(w)) return;
+  w->lru_prev = NULL;
+  w->lru_next = bank->lru_head;
+  if (bank->lru_head) bank->lru_head->lru_prev = w;
+  else bank->lru_tail = w;
+  bank->lru_head = w;
+  bank_evict(bank);
+}
+
+// Mixing kernels: widening accumulate of s16 frames into the s32 bus
+// (same layout, or mono into stereo) and the final halve-and-saturate
+// back to s16. All variants are bit-exact with the scalar ones.
+
+void accum_scalar(int32_t *buf, const int16_t *pcm, int n)
+{
+  for (int k = 0; k < n; k++) buf[k] += pcm[k];
+}
+
+void upmix_scalar(int32_t *buf, const int16_t *pcm, int n)
+{
+  for (int j = 0; j < n; j++) {
+    buf[j*2] += pcm[j];
+    buf[j*2+1] += pcm[j];
+  }
+}
+
+void pack_scalar(int16_t *out, const int32_t *buf, int n)
+{
+  for (int k = 0; k < n; k++) {
+    int32_t s = buf[k] >> 1;
+    if (s > INT16_MAX) s = INT16_MAX;
+    if (s < INT16_MIN) s = INT16_MIN;
+    out[k] = (int16_t)s;
+  }
+}
+
+#ifdef MA_SUPPORT_SSE2
+void accum_sse2(int32_t *buf, const int16_t *pcm, int n)
+{
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(pcm + k));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    __m128i *b = (__m128i *)(buf + k);
+    _mm_storeu_si128(b, _mm_add_epi32(_mm_loadu_si128(b), lo));
+    _mm_storeu_si128(b + 1, _mm_add_epi32(_mm_loadu_si128(b + 1), hi));
+  }
+  accum_scalar(buf + k, pcm + k, n - k);
+}
+
+void upmix_sse2(int32_t *buf, const int16_t *pcm, int n)
+{
+  int j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(pcm + j));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    __m128i d[4] = {
+      _mm_unpacklo_epi32(lo, lo), _mm_unpackhi_epi32(lo, lo),
+      _mm_unpacklo_epi32(hi, hi), _mm_unpackhi_epi32(hi, hi)
+    };
+    __m128i *b = (__m128i *)(buf + j*2);
+    for (int q = 0; q < 4; q++)
+      _mm_storeu_si128(b + q, _mm_add_epi32(_mm_loadu_si128(b + q), d[q]));
+  }
+  upmix_scalar(buf + j*2, pcm + j, n - j);
+}
+
+void pack_sse2(int16_t *out, const int32_t *buf, int n)
+{
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(buf + k)), 1);
+    __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(buf + k + 4)), 1);
+    _mm_storeu_si128((__m128i *)(out + k), _mm_packs_epi32(a, b));
+  }
+  pack_scalar(out + k, buf + k, n - k);
+}
+#endif
+
+#ifdef MIX_AVX2
+TARGET_AVX2 void accum_avx2(int32_t *buf, const int16_t *pcm, int n)
+{
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(pcm + k)));
+    __m256i *b = (__m256i *)(buf + k);
+    _mm256_storeu_si256(b, _mm256_add_epi32(_mm256_loadu_si256(b), x));
+  }
+  accum_scalar(buf + k, pcm + k, n - k);
+}
+
+TARGET_AVX2 void upmix_avx2(int32_t *buf, const int16_t *pcm, int n)
+{
+  const __m256i dup_lo = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+  const __m256i dup_hi = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+  int j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(pcm + j)));
+    __m256i *b = (__m256i *)(buf + j*2);
+    _mm256_storeu_si256(b, _mm256_add_epi32(_mm256_loadu_si256(b),
+      _mm256_permutevar8x32_epi32(x, dup_lo)));
+    _mm256_storeu_si256(b + 1, _mm256_add_epi32(_mm256_loadu_si256(b + 1),
+      _mm256_permutevar8x32_epi32(x, dup_hi)));
+  }
+  upmix_scalar(buf + j*2, pcm + j, n - j);
+}
+
+TARGET_AVX2 void pack_avx2(int16_t *out, const int32_t *buf, int n)
+{
+  int k = 0;
+  for (; k + 16 <= n; k += 16) {
+    __m256i a = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(buf + k)), 1);
+    __m256i b = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i *)(buf + k + 8)), 1);
+    // packs works per 128-bit lane; restore linear order afterwards
+    __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+    _mm256_storeu_si256((__m256i *)(out + k), p);
+  }
+  pack_scalar(out + k, buf + k, n - k);
+}
+
+int has_avx2(void)
+{
+  int info1[4], info7[4];
+  ma_cpuid(info1, 0);
+  if (info1[0] < 7) return 0;
+  ma_cpuid(info1, 1);
+  ma_cpuid(info7, 7);
+  if (!(info1[2] & (1 << 27)) || !(info7[1] & (1 << 5))) return 0;
+  return (ma_xgetbv(0) & 0x06) == 0x06;
+}
+#endif
+
+void (*mix_accum)(int32_t *buf, const int16_t *pcm, int n) = accum_scalar;
+void (*mix_upmix)(int32_t *buf, const int16_t *pcm, int n) = upmix_scalar;
+void (*mix_pack)(int16_t *out, const int32_t *buf, int n) = pack_scalar;
+
+// Picks the widest kernels the CPU supports, up to the requested level
+const char *mix_init(const char *want)
+{
+  const char *level = "scalar";
+  if (want && strcmp(want, "scalar") == 0) return level;
+#ifdef MA_SUPPORT_SSE2
+  if (ma_has_sse2()) {
+    mix_accum = accum_sse2;
+    mix_upmix = upmix_sse2;
+    mix_pack = pack_sse2;
+    level = "sse2";
+  }
+  if (want && strcmp(want, "sse2") == 0) return level;
+#endif
+#ifdef MIX_AVX2
+  if (has_avx2()) {
+    mix_accum = accum_avx2;
+    mix_upmix = upmix_avx2;
+    mix_pack = pack_avx2;
+    level = "avx2";
+  }
+#endif
+  return level;
+}
+
+// Part of the next `ns` frames where a voice has stored, non-silent audio
+int voice_window(const struct voice *v, int ns, int *from, int *to)
+{
+  const struct wave *w = v->w;
+  *from = v->ptr > w->head ? v->ptr : w->head;
+  *to = v->ptr + ns;
+  if (*to > w->head + w->span) *to = w->head + w->span;
+  if (*to > v->stop) *to = v->stop;
+  return *from < *to;
+}
+
+void mix_frames(int32_t *buf, const int16_t *pcm, int n, int wch, int ch)
+{
+  if (wch == ch) {
+    mix_accum(buf, pcm, n * ch);
+  } else if (ch == 2) {
+    mix_upmix(buf, pcm, n);
+  } else {
+    for (int j = 0; j < n; j++)
+      for (int c = 0; c < ch; c++)
+        buf[j*ch+c] += pcm[j];
+  }
+}
+
+// ADPCM waves are decoded a block at a time into scratch on the stack,
+// then summed by the same kernels as s16 ones
+void mix_wave(int32_t *buf, const struct voice *v, int ns, int ch)
+{
+  const struct wave *w = v->w;
+  int from, to;
+  if (!voice_window(v, ns, &from, &to)) return;
+  buf += (size_t)(from - v->ptr) * ch;
+  if (!w->adpcm) {
+    mix_frames(buf, w->pcm + (size_t)(from - w->head) * w->ch, to - from, w->ch, ch);
+    return;
+  }
+  int16_t tmp[ADPCM_BLOCK * 2];
+  for (int f = from - w->head; f < to - w->head; ) {
+    int b = f / ADPCM_BLOCK;
+    int end = to - w->head - b * ADPCM_BLOCK;
+    if (end > ADPCM_BLOCK) end = ADPCM_BLOCK;
+    int n = end - f % ADPCM_BLOCK;
+    adpcm_decode(w, b, f % ADPCM_BLOCK, end, tmp);
+    mix_frames(buf, tmp, n, w->ch, ch);
+    buf += (size_t)n * ch;
+    f += n;
+  }
+}
+
+void voices_drop_ended(struct voices *vs, struct bank *bank)
+{
+  int n = 0;
+  for (int i = 0; i < vs->count; i++) {
+    if (vs->v[i].ptr >= vs->v[i].stop) bank_release(bank, vs->v[i].w);
+    else vs->v[n++] = vs->v[i];
+  }
+  vs->count = n;
+}
+
+void voices_push(struct voices *vs, struct voice v)
+{
+  if (vs->count == vs->size) {
+    vs->size = vs->size ? vs->size * 2 : 64;
+    vs->v = realloc(vs->v, vs->size * sizeof(struct voice));
+  }
+  vs->v[vs->count++] = v;
+}
+
+// Starts a voice `delay` frames into the next block to be mixed
+void voice_start(struct voices *vs, struct bank *bank, struct wave *w, int delay,
+  int bus, struct take *take)
+{
+  int live = 0, oldest = -1, quietest = -1, same = -1;
+  for (int i = 0; i < vs->count; i++) {
+    struct voice *o = &vs->v[i];
+    if (o->ptr + delay >= o->stop) continue;
+    live++;
+    if (oldest < 0) oldest = i;
+    if (quietest < 0 || o->w->level < vs->v[quietest].w->level) quietest = i;
+    if (same < 0 && o->w == w) same = i;
+  }
+  if (live >= vs->cap) {
+    // Full: the victim is cut exactly where the new voice starts
+    int victim = oldest;
+    if (vs->policy == STEAL_QUIETEST) victim = quietest;
+    else if (vs->policy == STEAL_SAME && same >= 0) {
+      victim = same;
+      vs->stolen_same++;
+    }
+    struct voice *o = &vs->v[victim];
+    o->stop = o->ptr + delay;
+    if (o->take) o->take->stop = o->stop;
+    vs->stolen++;
+    live--;
+  }
+  if (vs->peak < live + 1) vs->peak = live + 1;
+  bank_acquire(bank, w);
+  struct voice v = { w, -delay, w->len, bus, take };
+  if (take) {
+    take->w = w;
+    take->stop = w->len;
+    take->bus = bus;
+  }
+  voices_push(vs, v);
+  vs->started++;
+}
+
+// Frame count until every active voice has finished
+long long voices_remaining(const struct voices *vs)
+{
+  long long r = 0;
+  for (int i = 0; i < vs->count; i++)
+    if (r < vs->v[i].stop - vs->v[i].ptr) r = vs->v[i].stop - vs->v[i].ptr;
+  return r;
+}
+
+// BS.1770 / EBU R128 measurement of the final s16 mix as it is written:
+// K-weighted gated loudness over 400 ms blocks (100 ms hop), sample peak,
+// and true peak from 4x polyphase oversampling
+#define TP_FACTOR 4
+#define TP_TAPS 49
+#define TP_HIST ((TP_TAPS + TP_FACTOR - 1) / TP_FACTOR)
+
+struct biquad { double b0, b1, b2, a1, a2; };
+
+struct meter {
+  int ch, sr;
+  struct biquad shelf, hp;
+  double state[8][4];
+  double sub[8], subs[4];
+  int sub_len, sub_fill;
+  long long sub_count;
+  double *blocks;
+  int block_count, block_cap;
+  double tp_coef[TP_TAPS];
+  double hist[8][TP_HIST];
+  int hist_pos;
+  double sample_peak, true_peak;
+  long long frames;
+};
+
+void meter_init(struct meter *mt, int ch, int sr)
+{
+  memset(mt, 0, sizeof *mt);
+  mt->ch = ch;
+  mt->sr = sr;
+
+  // K-weighting pre-filter (high shelf) and RLB high-pass, BS.1770 Annex 1
+  double f0 = 1681.974450955533, G = 3.999843853973347, Q = 0.7071752369554196;
+  double K = tan(MA_PI_D * f0 / sr);
+  double Vh = pow(10.0, G / 20.0), Vb = pow(Vh, 0.4996667741545416);
+  double a0 = 1.0 + K / Q + K * K;
+  mt->shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+  mt->shelf.b1 = 2.0 * (K * K - Vh) / a0;
+  mt->shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+  mt->shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+  mt->shelf.a2 = (1.0 - K / Q + K * K) / a0;
+
+  f0 = 38.13547087602444; Q = 0.5003270373238773;
+  K = tan(MA_PI_D * f0 / sr);
+  a0 = 1.0 + K / Q + K * K;
+  mt->hp.b0 = 1.0; mt->hp.b1 = -2.0; mt->hp.b2 = 1.0;
+  mt->hp.a1 = 2.0 * (K * K - 1.0) / a0;
+  mt->hp.a2 = (1.0 - K / Q + K * K) / a0;
+
+  mt->sub_len = sr / 10;
+
+  for (int j = 0; j < TP_TAPS; j++) {
+    double m = j - (TP_TAPS - 1) / 2.0;
+    double x = MA_PI_D * m / TP_FACTOR;
+    double sinc = m == 0 ? 1.0 : sin(x) / x;
+    double win = 0.5 * (1.0 - cos(2.0 * MA_PI_D * j / (TP_TAPS - 1)));
+    mt->tp_coef[j] = sinc * win;
+  }
+}
+
+double biquad_run(const struct biquad *f, double *z, double x)
+{
+  double y = f->b0 * x + z[0];
+  z[0] = f->b1 * x - f->a1 * y + z[1];
+  z[1] = f->b2 * x - f->a2 * y;
+  return y;
+}
+
+// Closes a 100 ms sub-block, and a 400 ms gating block every fourth one
+void meter_sub_done(struct meter *mt)
+{
+  double e = 0.0;
+  for (int c = 0; c < mt->ch; c++) {
+    e += mt->sub[c] / mt->sub_len;
+    mt->sub[c] = 0.0;
+  }
+  mt->sub_fill = 0;
+  mt->subs[mt->sub_count++ % 4] = e;
+  if (mt->sub_count < 4) return;
+  if (mt->block_count == mt->block_cap) {
+    mt->block_cap = mt->block_cap ? mt->block_cap * 2 : 1024;
+    mt->blocks = realloc(mt->blocks, mt->block_cap * sizeof(double));
+  }
+  mt->blocks[mt->block_count++] =
+    (mt->subs[0] + mt->subs[1] + mt->subs[2] + mt->subs[3]) / 4;
+}
+
+// True when silence in would give exactly silence out: filter state below
+// anything a double sum of s16 energy can register, interpolator empty
+int meter_settled(struct meter *mt)
+{
+  for (int c = 0; c < mt->ch; c++) {
+    for (int k = 0; k < 4; k++)
+      if (fabs(mt->state[c][k]) > 1e-30) return 0;
+    for (int k = 0; k < TP_HIST; k++)
+      if (mt->hist[c][k] != 0.0) return 0;
+  }
+  memset(mt->state, 0, sizeof mt->state);
+  return 1;
+}
+
+void meter_frame(struct meter *mt, const int16_t *pcm)
+{
+  mt->hist_pos = (mt->hist_pos + 1) % TP_HIST;
+  for (int c = 0; c < mt->ch; c++) {
+    double x = pcm[c] / 32768.0;
+    if (fabs(x) > mt->sample_peak) mt->sample_peak = fabs(x);
+
+    double y = biquad_run(&mt->shelf, mt->state[c], x);
+    y = biquad_run(&mt->hp, mt->state[c] + 2, y);
+    mt->sub[c] += y * y;
+
+    double *h = mt->hist[c];
+    h[mt->hist_pos] = x;
+    for (int f = 0; f < TP_FACTOR; f++) {
+      double v = 0.0;
+      for (int k = 0, j = f; j < TP_TAPS; k++, j += TP_FACTOR)
+        v += mt->tp_coef[j] * h[(mt->hist_pos - k + TP_HIST) % TP_HIST];
+      if (fabs(v) > mt->true_peak) mt->true_peak = fabs(v);
+    }
+  }
+  mt->frames++;
+  if (++mt->sub_fill == mt->sub_len) meter_sub_done(mt);
+}
+
+// Once the filters and interpolator have rung down, digital silence adds
+// nothing but time; only the 100 ms sub-block bookkeeping has to advance
+void meter_zeros(struct meter *mt, size_t frames)
+{
+  static const int16_t zero[8];
+  while (frames > 0 && !meter_settled(mt)) {
+    meter_frame(mt, zero);
+    frames--;
+  }
+  while (frames > 0) {
+    size_t n = mt->sub_len - mt->sub_fill;
+    if (n > frames) n = frames;
+    mt->frames += n;
+    mt->sub_fill += (int)n;
+    frames -= n;
+    if (mt->sub_fill == mt->sub_len) meter_sub_done(mt);
+  }
+}
+
+void meter_feed(struct meter *mt, const int16_t *pcm, size_t frames)
+{
+  for (size_t i = 0; i < frames; i++) meter_frame(mt, pcm + i * mt->ch);
+}
+
+double block_lufs(double z)
+{
+  return -0.691 + 10.0 * log10(z);
+}
+
+// Absolute gate at -70 LUFS, then relative gate 10 LU below the mean
+double meter_integrated(const struct meter *mt)
+{
+  double sum = 0.0;
+  int n = 0;
+  for (int i = 0; i < mt->block_count; i++)
+    if (mt->blocks[i] > 0 && block_lufs(mt->blocks[i]) >= -70.0) {
+      sum += mt->blocks[i];
+      n++;
+    }
+  if (n == 0) return -HUGE_VAL;
+  double rel = block_lufs(sum / n) - 10.0;
+  sum = 0.0;
+  n = 0;
+  for (int i = 0; i < mt->block_count; i++)
+    if (mt->blocks[i] > 0 && block_lufs(mt->blocks[i]) >= -70.0 &&
+        block_lufs(mt->blocks[i]) > rel) {
+      sum += mt->blocks[i];
+      n++;
+    }
+  return n ? block_lufs(sum / n) : -HUGE_VAL;
+}
+
+#define MIX_BLOCK 1024
+
+// Clamping and headroom as seen by the mixer before its final
+// halve-and-saturate: clamped samples per channel and per second, and a
+// histogram of per-block accumulator peaks in 1 dB bins from HR_FLOOR_DB
+// (the lowest bin also holds silent blocks) to past 256 stacked voices
+#define HR_FLOOR_DB -60
+#define HR_BINS 108
+
+struct headroom {
+  int ch, sr;
+  long clipped, channel[8];
+  long *second;
+  int seconds;
+  int32_t peak;
+  long blocks, hist[HR_BINS];
+};
+
+void headroom_init(struct headroom *hr, int ch, int sr)
+{
+  memset(hr, 0, sizeof *hr);
+  hr->ch = ch;
+  hr->sr = sr;
+}
+
+// Accumulator level in dB relative to the s16 full scale it is packed to
+double headroom_db(int32_t peak)
+{
+  return 20.0 * log10(peak / 65536.0);
+}
+
+void headroom_grow(struct headroom *hr, int seconds)
+{
+  if (seconds <= hr->seconds) return;
+  hr->second = realloc(hr->second, seconds * sizeof(long));
+  memset(hr->second + hr->seconds, 0, (seconds - hr->seconds) * sizeof(long));
+  hr->seconds = seconds;
+}
+
+void headroom_peak(struct headroom *hr, int32_t peak)
+{
+  int bin = 0;
+  if (peak > 0) {
+    double b = floor(headroom_db(peak) - HR_FLOOR_DB);
+    bin = b < 0 ? 0 : b >= HR_BINS ? HR_BINS - 1 : (int)b;
+  }
+  hr->hist[bin]++;
+  hr->blocks++;
+  if (hr->peak < peak) hr->peak = peak;
+}
+
+// Scans one mixed block of `ns` frames starting at output frame `at`
+void headroom_block(struct headroom *hr, const int32_t *bus, int ns, long long at)
+{
+  int32_t peak = 0;
+  for (int j = 0; j < ns; j++) {
+    for (int c = 0; c < hr->ch; c++) {
+      int32_t x = bus[j * hr->ch + c];
+      int32_t a = x < 0 ? -x : x;
+      if (a > peak) peak = a;
+      int32_t s = x >> 1;
+      if (s <= INT16_MAX && s >= INT16_MIN) continue;
+      int sec = (int)((at + j) / hr->sr);
+      headroom_grow(hr, sec + 1);
+      hr->second[sec]++;
+      hr->channel[c]++;
+      hr->clipped++;
+    }
+  }
+  headroom_peak(hr, peak);
+}
+
+void headroom_merge(struct headroom *hr, const struct headroom *from)
+{
+  hr->clipped += from->clipped;
+  for (int c = 0; c < hr->ch; c++) hr->channel[c] += from->channel[c];
+  headroom_grow(hr, from->seconds);
+  for (int k = 0; k < from->seconds; k++) hr->second[k] += from->second[k];
+  if (hr->peak < from->peak) hr->peak = from->peak;
+  hr->blocks += from->blocks;
+  for (int k = 0; k < HR_BINS; k++) hr->hist[k] += from->hist[k];
+}
+
+void json_db(FILE *f, int depth, const char *key, double v, const char *sep)
+{
+  if (isfinite(v)) fprintf(f, "%*s\"%s\": %.2f%s\n", depth * 2, "", key, v, sep);
+  else fprintf(f, "%*s\"%s\": null%s\n", depth * 2, "", key, sep);
+}
+
+void json_longs(FILE *f, const char *key, const long *v, int n, const char *sep)
+{
+  fprintf(f, "    \"%s\": [", key);
+  for (int k = 0; k < n; k++) fprintf(f, k ? ", %ld" : "%ld", v[k]);
+  fprintf(f, "]%s\n", sep);
+}
+
+int meter_report(const struct meter *mt, const struct voices *vs,
+  const struct headroom *hr, const char *path)
+{
+  FILE *f = fopen(path, "w");
+  if (!f) return 0;
+  fprintf(f, "{\n");
+  fprintf(f, "  \"sample_rate\": %d,\n", mt->sr);
+  fprintf(f, "  \"channels\": %d,\n", mt->ch);
+  fprintf(f, "  \"frames\": %lld,\n", mt->frames);
+  json_db(f, 1, "integrated_lufs", meter_integrated(mt), ",");
+  json_db(f, 1, "true_peak_dbtp", 20.0 * log10(mt->true_peak), ",");
+  json_db(f, 1, "sample_peak_dbfs", 20.0 * log10(mt->sample_peak), ",");
+  fprintf(f, "  \"clipped_samples\": %ld,\n", hr->clipped);
+  fprintf(f, "  \"headroom\": {\n");
+  json_db(f, 2, "accumulator_peak_dbfs", headroom_db(hr->peak), ",");
+  json_db(f, 2, "max_gain_db", -headroom_db(hr->peak), ",");
+  json_longs(f, "clipped_per_channel", hr->channel, hr->ch, ",");
+  int seconds = (int)((mt->frames + mt->sr - 1) / mt->sr);
+  long *per_second = calloc(seconds + 1, sizeof(long));
+  if (hr->second)
+    memcpy(per_second, hr->second,
+      (hr->seconds < seconds ? hr->seconds : seconds) * sizeof(long));
+  json_longs(f, "clipped_per_second", per_second, seconds, ",");
+  free(per_second);
+  fprintf(f, "    \"block_frames\": %d,\n", MIX_BLOCK);
+  fprintf(f, "    \"blocks\": %ld,\n", hr->blocks);
+  fprintf(f, "    \"peak_histogram_floor_db\": %d,\n", HR_FLOOR_DB);
+  json_longs(f, "peak_histogram", hr->hist, HR_BINS, "");
+  fprintf(f, "  },\n");
+  fprintf(f, "  \"voices\": {\n");
+  fprintf(f, "    \"limit\": %d,\n", vs->cap);
+  fprintf(f, "    \"policy\": \"%s\",\n", steal_names[vs->policy]);
+  fprintf(f, "    \"started\": %ld,\n", vs->started);
+  fprintf(f, "    \"peak\": %d,\n", vs->peak);
+  fprintf(f, "    \"stolen\": %ld,\n", vs->stolen);
+  fprintf(f, "    \"stolen_same_index\": %ld\n", vs->stolen_same);
+  fprintf(f, "  }\n");
+  fprintf(f, "}\n");
+  fclose(f);
+  return 1;
+}
+
+// Where a rendered stream goes: a stdio file, or memory when `mem` is set.
+// A meter attached to a sink measures the s16 frames written through it.
+// Runs of silence on a regular file are left as a hole that the next write
+// seeks over (or sink_finish extends the file across), so the filesystem
+// can keep them sparse; other files get the zeros written out.
+struct avi;
+void avi_audio(struct avi *a, const void *data, size_t size);
+struct writer;
+struct sink;
+struct split;
+void split_next_audio(struct sink *s);
+
+struct sink {
+  FILE *f;
+  uint8_t *mem;
+  struct avi *avi;
+  struct meter *meter;
+  int sparse;
+  long long hole, zeros;
+  // Output opened by path (-o): whole aligned chunks of `buf` are written
+  // at `pos` with pwrite, optionally through O_DIRECT; silence from a
+  // chunk boundary waits in `hole`
+  uint8_t *buf;
+  size_t fill;
+  int fd, direct;
+  long long pos;
+  // Pipe output (--splice): `buf` is a ring of two chunks whose pages are
+  // handed to the pipe with vmsplice, or written when that is refused
+  int piped, splice;
+  size_t sent;
+  // Output carried out on the writer's thread when set
+  struct writer *writer;
+  // Audio cut into segments: bytes left before the next cut
+  struct split *split;
+  long long left;
+  // errno of the first write that failed; what follows is not trusted
+  int error;
+};
+
+#define SINK_HOLE_MIN 65536
+#define SINK_CHUNK (1 << 20)
+#define SINK_ALIGN 4096
+
+long long file_tell(FILE *f)
+{
+#ifdef _WIN32
+  return _ftelli64(f);
+#else
+  return ftello(f);
+#endif
+}
+
+int file_seek(FILE *f, long long off, int whence)
+{
+#ifdef _WIN32
+  return _fseeki64(f, off, whence);
+#else
+  return fseeko(f, (off_t)off, whence);
+#endif
+}
+
+int file_resize(FILE *f, long long size)
+{
+  fflush(f);
+#ifdef _WIN32
+  return _chsize_s(_fileno(f), size);
+#else
+  return ftruncate(fileno(f), (off_t)size);
+#endif
+}
+
+void sink_open(struct sink *s, FILE *f)
+{
+  struct stat st;
+  s->f = f;
+  s->sparse = fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) &&
+    file_tell(f) >= 0;
+#ifndef _WIN32
+  // Appends land at the end whatever the position, so seeking cannot skip
+  if (fcntl(fileno(f), F_GETFL) & O_APPEND) s->sparse = 0;
+#endif
+}
+
+// Opens `path` for output of about `size` bytes, reserving the space up
+// front where the filesystem supports it
+int sink_create(struct sink *s, const char *path, long long size, int direct)
+{
+  if (strncmp(path, "fd:", 3) == 0) {
+    FILE *f = fdopen(atoi(path + 3), "wb");
+    if (!f) return 0;
+    sink_open(s, f);
+    return 1;
+  }
+#ifdef _WIN32
+  (void)size;
+  (void)direct;
+  FILE *f = fopen(path, "wb");
+  if (!f) return 0;
+  setvbuf(f, NULL, _IOFBF, SINK_CHUNK);
+  sink_open(s, f);
+  return 1;
+#else
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  int fd = -1;
+#ifdef O_DIRECT
+  if (direct) {
+    fd = open(path, flags | O_DIRECT, 0666);
+    if (fd < 0) fprintf(stderr, "O_DIRECT unavailable for %s, using buffered writes\n", path);
+  }
+#endif
+  if (fd < 0) {
+    direct = 0;
+    fd = open(path, flags, 0666);
+  }
+  if (fd < 0) return 0;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    // Pipes and devices take plain sequential writes
+    FILE *f = fdopen(fd, "wb");
+    if (!f) return 0;
+    setvbuf(f, NULL, _IOFBF, SINK_CHUNK);
+    sink_open(s, f);
+    return 1;
+  }
+#ifdef __linux__
+  // Keeps the visible size at what has been written; sink_finish trims
+  // whatever the estimate reserved beyond the end, and sink_skip gives
+  // back the silence it skips
+  if (size > 0) fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#endif
+  s->fd = fd;
+  s->direct = direct;
+  s->buf = ma_aligned_malloc(SINK_CHUNK, SINK_ALIGN, NULL);
+  s->fill = 0;
+  s->pos = 0;
+  return 1;
+#endif
+}
+
+#ifdef __linux__
+// Switches a pipe output over to the ring. Nothing may have been written
+// through its FILE yet.
+void sink_pipe(struct sink *s)
+{
+  struct stat st;
+  if (!s->f || s->buf || fstat(fileno(s->f), &st) != 0 || !S_ISFIFO(st.st_mode))
+    return;
+  int fd = fileno(s->f);
+  // The ring relies on the pipe holding no more than one chunk. A pipe
+  // already smaller than that does as well if it cannot be resized.
+  fcntl(fd, F_SETPIPE_SZ, SINK_CHUNK);
+  int size = fcntl(fd, F_GETPIPE_SZ);
+  if (size < 0 || size > SINK_CHUNK) {
+    fprintf(stderr, "Pipe larger than %d KB, writing it without vmsplice\n",
+      SINK_CHUNK >> 10);
+    return;
+  }
+  s->fd = fd;
+  s->buf = ma_aligned_malloc(2 * SINK_CHUNK, SINK_ALIGN, NULL);
+  if (!s->buf) return;
+  s->piped = 1;
+  s->splice = 1;
+  s->fill = 0;
+  s->sent = 0;
+}
+
+// Leaves splicing for plain writes into a ring of its own. Pages already
+// handed over may still sit unread in the pipe, so the old ring is never
+// written again nor freed.
+void sink_unsplice(struct sink *s)
+{
+  uint8_t *buf = ma_aligned_malloc(2 * SINK_CHUNK, SINK_ALIGN, NULL);
+  s->splice = 0;
+  if (!buf) {
+    s->error = ENOMEM;
+    return;
+  }
+  memcpy(buf, s->buf, s->fill);
+  s->buf = buf;
+}
+
+// Hands the unsent part of the ring to the pipe. Pages given with vmsplice
+// stay referenced until read, but a pipe of one chunk is drained of a half
+// by the time the other half has gone in after it, so the ring only turns
+// over at half boundaries. That holds only while the pipe stays that
+// small, so its size is checked before each splice. A reader that splices
+// the pages onward would break it too, and pages are reused, so they are
+// never gifted.
+void sink_send(struct sink *s)
+{
+  if (s->splice) {
+    int size = fcntl(s->fd, F_GETPIPE_SZ);
+    if (size < 0 || size > SINK_CHUNK) sink_unsplice(s);
+  }
+  uint8_t *p = s->buf + s->sent;
+  size_t n = s->fill - s->sent;
+  while (n > 0 && !s->error) {
+    ssize_t r;
+    if (s->splice) {
+      struct iovec iov = { p, n };
+      r = vmsplice(s->fd, &iov, 1, 0);
+      if (r < 0 && errno != EINTR) {
+        s->splice = 0;
+        continue;
+      }
+    } else {
+      r = write(s->fd, p, n);
+    }
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      s->error = r < 0 ? errno : EIO;
+      break;
+    }
+    p += r;
+    n -= r;
+  }
+  s->sent = s->fill;
+  if (s->fill == 2 * SINK_CHUNK) {
+    s->fill = 0;
+    s->sent = 0;
+  }
+}
+#else
+void sink_pipe(struct sink *s)
+{
+  (void)s;
+}
+#endif
+
+#ifndef _WIN32
+void sink_flush(struct sink *s)
+{
+#ifdef __linux__
+  if (s->piped) {
+    sink_send(s);
+    return;
+  }
+#endif
+  const uint8_t *p = s->buf;
+  size_t n = s->fill;
+  while (n > 0 && !s->error) {
+    ssize_t r = pwrite(s->fd, p, n, s->pos);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      s->error = r < 0 ? errno : EIO;
+      break;
+    }
+    p += r;
+    n -= r;
+    s->pos += r;
+  }
+  s->fill = 0;
+}
+#endif
+
+#ifndef _WIN32
+// Moves past the silence held back as a hole: whole chunks are skipped,
+// and given back where sink_create reserved them, so they read back as
+// zeros without taking space; the rest goes into the buffer
+void sink_skip(struct sink *s)
+{
+  long long skip = s->hole / SINK_CHUNK * SINK_CHUNK;
+#ifdef __linux__
+  // Holes are only punched below the visible size, so that comes first
+  if (skip && ftruncate(s->fd, s->pos + skip) == 0)
+    fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, s->pos, skip);
+#endif
+  s->pos += skip;
+  s->fill = (size_t)(s->hole - skip);
+  memset(s->buf, 0, s->fill);
+  s->hole = 0;
+}
+#endif
+
+void sink_buffer(struct sink *s, const uint8_t *data, size_t size)
+{
+#ifndef _WIN32
+  if (data && s->hole) sink_skip(s);
+  while (size > 0) {
+    // Silence from a chunk boundary on is held back until data follows
+    if (!data && !s->piped && s->fill == 0) {
+      s->hole += size;
+      return;
+    }
+    size_t end = s->piped && s->fill >= SINK_CHUNK ? 2 * SINK_CHUNK : SINK_CHUNK;
+    size_t n = end - s->fill;
+    if (n > size) n = size;
+    if (data) {
+      memcpy(s->buf + s->fill, data, n);
+      data += n;
+    } else {
+      memset(s->buf + s->fill, 0, n);
+    }
+    s->fill += n;
+    size -= n;
+    if (s->fill == end) sink_flush(s);
+  }
+#endif
+}
+
+void sink_put_zeros(FILE *f, long long size)
+{
+  static const uint8_t zero[16384];
+  while (size > 0) {
+    size_t n = size < (long long)sizeof zero ? (size_t)size : sizeof zero;
+    fwrite(zero, 1, n, f);
+    size -= n;
+  }
+}
+
+// Brings the file position up to the end of any pending hole
+void sink_fill(struct sink *s)
+{
+  if (!s->hole) return;
+  if (s->hole < SINK_HOLE_MIN || file_seek(s->f, s->hole, SEEK_CUR) != 0)
+    sink_put_zeros(s->f, s->hole);
+  s->hole = 0;
+}
+
+// Puts bytes, or zeros when `data` is NULL, where the sink leads
+void sink_out(struct sink *s, const void *data, size_t size)
+{
+  if (s->avi) {
+    avi_audio(s->avi, data, size);
+  } else if (s->mem) {
+    if (data) memcpy(s->mem, data, size);
+    else memset(s->mem, 0, size);
+    s->mem += size;
+  } else if (s->buf) {
+    sink_buffer(s, data, size);
+  } else if (data) {
+    sink_fill(s);
+    fwrite(data, 1, size, s->f);
+  } else if (s->sparse) {
+    s->hole += size;
+  } else {
+    sink_put_zeros(s->f, size);
+  }
+}
+
+void sink_hand(struct sink *s)
+{
+#ifndef _WIN32
+  if (s->piped) {
+    sink_flush(s);
+    return;
+  }
+#endif
+  if (s->f && !s->sparse) fflush(s->f);
+}
+
+// Output thread, so that rendering overlaps writes to a slow reader. Sink
+// output is copied into a ring of chunks allocated up front, coalescing
+// runs for the same sink, and carried out in order on the thread; once
+// every chunk is queued the renderer waits for one to come back.
+#define WRITER_SLOTS 8
+
+enum slot_op { SLOT_DATA, SLOT_ZERO, SLOT_PUSH, SLOT_SYNC, SLOT_STOP };
+
+struct slot {
+  struct sink *s;
+  enum slot_op op;
+  uint8_t *data;
+  size_t size;
+};
+
+struct writer {
+  struct slot slots[WRITER_SLOTS];
+  // Next slot to fill and next to carry out; `open` while head is filling
+  int head, tail, open;
+  ma_semaphore free, full;
+  ma_event synced;
+  ma_thread thread;
+};
+
+ma_thread_result MA_THREADCALL writer_run(void *data)
+{
+  struct writer *w = data;
+  for (;;) {
+    ma_semaphore_wait(&w->full);
+    struct slot *sl = &w->slots[w->tail];
+    w->tail = (w->tail + 1) % WRITER_SLOTS;
+    enum slot_op op = sl->op;
+    if (op == SLOT_DATA) sink_out(sl->s, sl->data, sl->size);
+    else if (op == SLOT_ZERO) sink_out(sl->s, NULL, sl->size);
+    else if (op == SLOT_PUSH) sink_hand(sl->s);
+    ma_semaphore_release(&w->free);
+    if (op == SLOT_SYNC) ma_event_signal(&w->synced);
+    if (op == SLOT_STOP) return (ma_thread_result)0;
+  }
+}
+
+// Returns NULL where no thread can be started; sinks then write directly
+struct writer *writer_start(void)
+{
+  struct writer *w = calloc(1, sizeof(struct writer));
+  for (int k = 0; k < WRITER_SLOTS; k++)
+    w->slots[k].data = malloc(SINK_CHUNK);
+  ma_semaphore_init(WRITER_SLOTS, &w->free);
+  ma_semaphore_init(0, &w->full);
+  ma_event_init(&w->synced);
+  if (ma_thread_create(&w->thread, ma_thread_priority_normal, 0,
+      writer_run, w, NULL) != MA_SUCCESS) {
+    for (int k = 0; k < WRITER_SLOTS; k++) free(w->slots[k].data);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+void writer_submit(struct writer *w)
+{
+  if (!w->open) return;
+  w->head = (w->head + 1) % WRITER_SLOTS;
+  w->open = 0;
+  ma_semaphore_release(&w->full);
+}
+
+// Slot at the head for `op` on `s`, reusing the one being filled if it
+// can take more
+struct slot *writer_slot(struct writer *w, struct sink *s, enum slot_op op)
+{
+  struct slot *sl = &w->slots[w->head];
+  if (w->open && sl->s == s && sl->op == op &&
+      (op == SLOT_ZERO || (op == SLOT_DATA && sl->size < SINK_CHUNK)))
+    return sl;
+  writer_submit(w);
+  ma_semaphore_wait(&w->free);
+  w->open = 1;
+  sl = &w->slots[w->head];
+  sl->s = s;
+  sl->op = op;
+  sl->size = 0;
+  return sl;
+}
+
+// Queues bytes, or zeros when `data` is NULL
+void writer_put(struct writer *w, struct sink *s, const uint8_t *data, size_t size)
+{
+  if (!data) {
+    writer_slot(w, s, SLOT_ZERO)->size += size;
+    return;
+  }
+  while (size > 0) {
+    struct slot *sl = writer_slot(w, s, SLOT_DATA);
+    size_t n = SINK_CHUNK - sl->size;
+    if (n > size) n = size;
+    memcpy(sl->data + sl->size, data, n);
+    sl->size += n;
+    data += n;
+    size -= n;
+  }
+}
+
+void writer_op(struct writer *w, struct sink *s, enum slot_op op)
+{
+  writer_slot(w, s, op);
+  writer_submit(w);
+}
+
+// Waits until everything queued has been carried out
+void writer_sync(struct writer *w)
+{
+  writer_op(w, NULL, SLOT_SYNC);
+  ma_event_wait(&w->synced);
+}
+
+void writer_stop(struct writer *w)
+{
+  writer_op(w, NULL, SLOT_STOP);
+  ma_thread_wait(&w->thread);
+  ma_semaphore_uninit(&w->free);
+  ma_semaphore_uninit(&w->full);
+  ma_event_uninit(&w->synced);
+  for (int k = 0; k < WRITER_SLOTS; k++) free(w->slots[k].data);
+  free(w);
+}
+
+void sink_put(struct sink *s, const uint8_t *data, size_t size)
+{
+  if (s->writer) writer_put(s->writer, s, data, size);
+  else sink_out(s, data, size);
+}
+
+// Writes bytes that are not samples, such as a container header, moving
+// on to the next segment file at each cut on the way
+void sink_raw(struct sink *s, const void *data, size_t size)
+{
+  const uint8_t *p = data;
+  while (s->split && (long long)size > s->left) {
+    size_t n = (size_t)s->left;
+    sink_put(s, p, n);
+    if (p) p += n;
+    size -= n;
+    split_next_audio(s);
+  }
+  if (s->split) s->left -= size;
+  sink_put(s, p, size);
+}
+
+void sink_write(struct sink *s, const void *data, size_t size)
+{
+  if (s->meter)
+    meter_feed(s->meter, data, size / (s->meter->ch * sizeof(int16_t)));
+  sink_raw(s, data, size);
+}
+
+void sink_zero(struct sink *s, size_t size)
+{
+  if (s->meter)
+    meter_zeros(s->meter, size / (s->meter->ch * sizeof(int16_t)));
+  s->zeros += size;
+  sink_raw(s, NULL, size);
+}
+
+// Hands buffered data on to a pipe or device, so that a reader taking two
+// streams in step is never left waiting on one while the other fills up
+void sink_push(struct sink *s)
+{
+  if (s->writer) writer_op(s->writer, s, SLOT_PUSH);
+  else sink_hand(s);
+}
+
+// Writes through a buffer that may hold silence, turning whole zero pages
+// into holes
+void sink_write_sparse(struct sink *s, const void *data, size_t size)
+{
+  static const uint8_t zero[4096];
+  const uint8_t *p = data;
+  while (size > 0) {
+    size_t n = size < sizeof zero ? size : sizeof zero;
+    size_t run = 0;
+    while (run + n <= size && memcmp(p + run, zero, n) == 0) run += n;
+    if (run) {
+      sink_zero(s, run);
+    } else {
+      while (run < size && (size - run < n || memcmp(p + run, zero, n) != 0))
+        run += size - run < n ? size - run : n;
+      sink_write(s, p, run);
+    }
+    p += run;
+    size -= run;
+  }
+}
+
+// Materializes a trailing hole; the file position ends up at its end.
+// Output opened by path is flushed, cut to its length and closed. A pipe
+// is left to its FILE, and its ring to the pages still in the pipe.
+// Returns 0 when anything written to the sink failed to get out.
+int sink_finish(struct sink *s)
+{
+  if (s->writer) writer_sync(s->writer);
+#ifndef _WIN32
+  if (s->piped) {
+    sink_flush(s);
+    return !s->error;
+  }
+  if (s->buf) {
+    if (s->hole) sink_skip(s);
+    long long end = s->pos + s->fill;
+    if (s->direct && s->fill % SINK_ALIGN) {
+      size_t pad = SINK_ALIGN - s->fill % SINK_ALIGN;
+      memset(s->buf + s->fill, 0, pad);
+      s->fill += pad;
+    }
+    sink_flush(s);
+    if (!s->error && ftruncate(s->fd, end) != 0) s->error = errno;
+    if (close(s->fd) != 0 && !s->error) s->error = errno;
+    ma_aligned_free(s->buf, NULL);
+    s->buf = NULL;
+    return !s->error;
+  }
+#endif
+  if (s->mem || s->avi) return 1;
+  if (s->hole) {
+    fflush(s->f);
+    long long end = file_tell(s->f) + s->hole;
+    if (s->hole < SINK_HOLE_MIN || file_resize(s->f, end) != 0 ||
+        file_seek(s->f, end, SEEK_SET) != 0)
+      sink_put_zeros(s->f, s->hole);
+    s->hole = 0;
+  }
+  if ((fflush(s->f) != 0 || ferror(s->f)) && !s->error) s->error = errno ? errno : EIO;
+  return !s->error;
+}
+
+void put_le(uint8_t *p, uint32_t v, int n)
+{
+  for (int i = 0; i < n; i++) p[i] = (v >> (i * 8)) & 0xff;
+}
+
+// Header of a 16-bit PCM WAV holding `frames`; data too long for RIFF
+// sizes gets an RF64 header with a ds64 chunk. Returns its length.
+int wav_format(uint8_t *h, int ch, int sr, long long frames)
+{
+  long long data = frames * ch * (long long)sizeof(int16_t);
+  int rf64 = data > 0xFFFFFFFFLL - 72;
+  int fmt = rf64 ? 48 : 12;
+  int len = fmt + 32;
+  memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+  put_le(h + 4, rf64 ? 0xFFFFFFFF : (uint32_t)(len - 8 + data), 4);
+  memcpy(h + 8, "WAVE", 4);
+  if (rf64) {
+    long long riff = len - 8 + data;
+    memcpy(h + 12, "ds64", 4); put_le(h + 16, 28, 4);
+    put_le(h + 20, (uint32_t)riff, 4); put_le(h + 24, (uint32_t)(riff >> 32), 4);
+    put_le(h + 28, (uint32_t)data, 4); put_le(h + 32, (uint32_t)(data >> 32), 4);
+    put_le(h + 36, (uint32_t)frames, 4); put_le(h + 40, (uint32_t)(frames >> 32), 4);
+    put_le(h + 44, 0, 4);
+  }
+  memcpy(h + fmt, "fmt ", 4); put_le(h + fmt + 4, 16, 4);
+  put_le(h + fmt + 8, 1, 2); put_le(h + fmt + 10, ch, 2);
+  put_le(h + fmt + 12, sr, 4); put_le(h + fmt + 16, sr * ch * 2, 4);
+  put_le(h + fmt + 20, ch * 2, 2); put_le(h + fmt + 22, 16, 2);
+  memcpy(h + fmt + 24, "data", 4);
+  put_le(h + fmt + 28, rf64 ? 0xFFFFFFFF : (uint32_t)data, 4);
+  return len;
+}
+
+void wav_header(FILE *f, int ch, int sr, long long frames)
+{
+  uint8_t h[80];
+  fwrite(h, 1, wav_format(h, ch, sr, frames), f);
+}
+
+// Rewrites the 44-byte header of a WAV file once its length is known
+void wav_close(FILE *f, int ch, int sr)
+{
+  long long frames = (file_tell(f) - 44) / (ch * (long long)sizeof(int16_t));
+  long long most = (0xFFFFFFFFLL - 72) / (ch * (long long)sizeof(int16_t));
+  fseek(f, 0, SEEK_SET);
+  wav_header(f, ch, sr, frames < most ? frames : most);
+  fclose(f);
+}
+
+// Y4M stream header; frames follow as "FRAME\n" and three full planes
+void y4m_header(char *h, int w, int hgt, double fps)
+{
+  sprintf(h, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=LIMITED\n",
+    w, hgt, (int)fps);
+}
+
+// BT.601 studio range, which Y4M readers assume, at full chroma resolution
+void rgb_to_yuv444(uint8_t *yuv, const uint8_t *rgb, size_t n)
+{
+  uint8_t *y = yuv, *u = yuv + n, *v = yuv + 2 * n;
+  for (size_t i = 0; i < n; i++) {
+    int r = rgb[i*3], g = rgb[i*3+1], b = rgb[i*3+2];
+    y[i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    u[i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+    v[i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+  }
+}
+
+// OpenDML AVI with uncompressed bottom-up BGR video and interleaved s16
+// PCM, one audio chunk after each video frame. A frame that repeats the
+// previous one is an empty chunk. RIFFs are cut at AVI_RIFF_MAX bytes and
+// each carries ix## indexes; the header holds the super indexes pointing
+// at them, and the first RIFF also gets an idx1 for older readers.
+#define AVI_RIFF_MAX (1LL << 30)
+#define AVI_SUPER_MAX 1024
+#define AVI_SUPER_BYTES (32 + AVI_SUPER_MAX * 16)
+
+struct avi_chunk { uint32_t offset, size; uint8_t stream, key; };
+
+struct avi {
+  FILE *f;
+  int w, h, ch, sr, fps;
+  size_t stride;
+  uint8_t *bgr;
+  uint8_t *audio;
+  size_t audio_fill, audio_cap;
+  // Current RIFF and its movi LIST, and the chunks written into it
+  long long riff, movi;
+  struct avi_chunk *chunks;
+  int chunk_count, chunk_cap;
+  long long riff_frames, riff_samples;
+  // One super index entry per RIFF and stream
+  int riffs;
+  long long super_off[2][AVI_SUPER_MAX];
+  uint32_t super_size[2][AVI_SUPER_MAX], super_dur[2][AVI_SUPER_MAX];
+  long long frames, samples, first_frames;
+  uint32_t max_chunk[2];
+  // errno of the first seek that failed; writes are left to ferror()
+  int error;
+};
+
+void avi_put(FILE *f, uint32_t v, int n)
+{
+  uint8_t b[4];
+  put_le(b, v, n);
+  fwrite(b, 1, n, f);
+}
+
+void avi_put64(FILE *f, long long v)
+{
+  avi_put(f, (uint32_t)v, 4);
+  avi_put(f, (uint32_t)(v >> 32), 4);
+}
+
+long long avi_begin(FILE *f, const char *tag, const char *type)
+{
+  long long at = file_tell(f);
+  fwrite(tag, 1, 4, f);
+  avi_put(f, 0, 4);
+  if (type) fwrite(type, 1, 4, f);
+  return at;
+}
+
+// Patches the size of a chunk or LIST started at `at` to end here
+void avi_end(struct avi *a, long long at)
+{
+  long long end = file_tell(a->f);
+  if (end < 0 || file_seek(a->f, at + 4, SEEK_SET) != 0) {
+    if (!a->error) a->error = errno;
+    return;
+  }
+  avi_put(a->f, (uint32_t)(end - at - 8), 4);
+  if (file_seek(a->f, end, SEEK_SET) != 0 && !a->error) a->error = errno;
+}
+
+void avi_super_index(struct avi *a, int s)
+{
+  long long at = avi_begin(a->f, "indx", NULL);
+  avi_put(a->f, 4, 2);
+  avi_put(a->f, 0, 1);
+  avi_put(a->f, 0, 1);  // AVI_INDEX_OF_INDEXES
+  avi_put(a->f, a->riffs, 4);
+  fwrite(s ? "01wb" : "00db", 1, 4, a->f);
+  for (int k = 0; k < 3; k++) avi_put(a->f, 0, 4);
+  for (int k = 0; k < AVI_SUPER_MAX; k++) {
+    avi_put64(a->f, k < a->riffs ? a->super_off[s][k] : 0);
+    avi_put(a->f, k < a->riffs ? a->super_size[s][k] : 0, 4);
+    avi_put(a->f, k < a->riffs ? a->super_dur[s][k] : 0, 4);
+  }
+  avi_end(a, at);
+}
+
+// The hdrl LIST, written with placeholders first and again at the end;
+// its size does not depend on the contents
+void avi_header(struct avi *a)
+{
+  FILE *f = a->f;
+  int block = a->ch * 2;
+  uint32_t frame_size = (uint32_t)(a->stride * a->h);
+  long long hdrl = avi_begin(f, "LIST", "hdrl");
+  long long at = avi_begin(f, "avih", NULL);
+  avi_put(f, 1000000 / a->fps, 4);
+  avi_put(f, frame_size * a->fps + a->sr * block, 4);
+  avi_put(f, 0, 4);
+  avi_put(f, 0x10 | 0x100, 4);  // AVIF_HASINDEX | AVIF_ISINTERLEAVED
+  avi_put(f, (uint32_t)a->first_frames, 4);
+  avi_put(f, 0, 4);
+  avi_put(f, 2, 4);
+  avi_put(f, a->max_chunk[0] > a->max_chunk[1] ? a->max_chunk[0] : a->max_chunk[1], 4);
+  avi_put(f, a->w, 4);
+  avi_put(f, a->h, 4);
+  for (int k = 0; k < 4; k++) avi_put(f, 0, 4);
+  avi_end(a, at);
+
+  for (int s = 0; s < 2; s++) {
+    long long strl = avi_begin(f, "LIST", "strl");
+    at = avi_begin(f, "strh", NULL);
+    fwrite(s ? "auds" : "vids", 1, 4, f);
+    avi_put(f, 0, 4);
+    avi_put(f, 0, 4);
+    avi_put(f, 0, 4);
+    avi_put(f, 0, 4);
+    avi_put(f, s ? block : 1, 4);
+    avi_put(f, s ? a->sr * block : a->fps, 4);
+    avi_put(f, 0, 4);
+    avi_put(f, (uint32_t)(s ? a->samples : a->frames), 4);
+    avi_put(f, a->max_chunk[s], 4);
+    avi_put(f, 0xFFFFFFFF, 4);
+    avi_put(f, s ? block : 0, 4);
+    avi_put(f, 0, 2); avi_put(f, 0, 2);
+    avi_put(f, s ? 0 : a->w, 2); avi_put(f, s ? 0 : a->h, 2);
+    avi_end(a, at);
+
+    at = avi_begin(f, "strf", NULL);
+    if (s) {
+      avi_put(f, 1, 2);
+      avi_put(f, a->ch, 2);
+      avi_put(f, a->sr, 4);
+      avi_put(f, a->sr * block, 4);
+      avi_put(f, block, 2);
+      avi_put(f, 16, 2);
+      avi_put(f, 0, 2);
+    } else {
+      avi_put(f, 40, 4);
+      avi_put(f, a->w, 4);
+      avi_put(f, a->h, 4);  // positive: rows are stored bottom-up
+      avi_put(f, 1, 2);
+      avi_put(f, 24, 2);
+      avi_put(f, 0, 4);  // BI_RGB
+      avi_put(f, frame_size, 4);
+      for (int k = 0; k < 4; k++) avi_put(f, 0, 4);
+    }
+    avi_end(a, at);
+    avi_super_index(a, s);
+    avi_end(a, strl);
+  }
+
+  long long odml = avi_begin(f, "LIST", "odml");
+  at = avi_begin(f, "dmlh", NULL);
+  avi_put(f, (uint32_t)a->frames, 4);
+  for (int k = 0; k < 61; k++) avi_put(f, 0, 4);
+  avi_end(a, at);
+  avi_end(a, odml);
+  avi_end(a, hdrl);
+}
+
+// Writes the ix## indexes of the current RIFF, closes it, and for the
+// first one adds idx1
+void avi_end_riff(struct avi *a)
+{
+  FILE *f = a->f;
+  if (a->riffs == AVI_SUPER_MAX) {
+    fprintf(stderr, "AVI too long for its index\n");
+    exit(1);
+  }
+  for (int s = 0; s < 2; s++) {
+    int n = 0;
+    for (int k = 0; k < a->chunk_count; k++) n += a->chunks[k].stream == s;
+    long long at = avi_begin(f, s ? "ix01" : "ix00", NULL);
+    avi_put(f, 2, 2);
+    avi_put(f, 0, 1);
+    avi_put(f, 1, 1);  // AVI_INDEX_OF_CHUNKS
+    avi_put(f, n, 4);
+    fwrite(s ? "01wb" : "00db", 1, 4, f);
+    avi_put64(f, a->movi);
+    avi_put(f, 0, 4);
+    for (int k = 0; k < a->chunk_count; k++) {
+      const struct avi_chunk *c = &a->chunks[k];
+      if (c->stream != s) continue;
+      avi_put(f, c->offset + 8, 4);
+      avi_put(f, c->size | (c->key ? 0 : 0x80000000u), 4);
+    }
+    avi_end(a, at);
+    a->super_off[s][a->riffs] = at;
+    a->super_size[s][a->riffs] = (uint32_t)(file_tell(f) - at);
+    a->super_dur[s][a->riffs] = (uint32_t)(s ? a->riff_samples : a->riff_frames);
+  }
+  avi_end(a, a->movi);
+
+  if (a->riffs == 0) {
+    long long at = avi_begin(f, "idx1", NULL);
+    for (int k = 0; k < a->chunk_count; k++) {
+      const struct avi_chunk *c = &a->chunks[k];
+      fwrite(c->stream ? "01wb" : "00db", 1, 4, f);
+      avi_put(f, c->key ? 0x10 : 0, 4);  // AVIIF_KEYFRAME
+      avi_put(f, c->offset - 8, 4);
+      avi_put(f, c->size, 4);
+    }
+    avi_end(a, at);
+    a->first_frames = a->riff_frames;
+  }
+  avi_end(a, a->riff);
+  a->riffs++;
+  a->chunk_count = 0;
+  a->riff_frames = a->riff_samples = 0;
+}
+
+void avi_chunk(struct avi *a, int stream, const void *data, uint32_t size, int key)
+{
+  long long pos = file_tell(a->f);
+  long long reserve = 64 + (a->chunk_count + 1) * 24LL;
+  if (pos - a->riff + 8 + size + reserve > AVI_RIFF_MAX && a->chunk_count > 0) {
+    avi_end_riff(a);
+    a->riff = avi_begin(a->f, "RIFF", "AVIX");
+    a->movi = avi_begin(a->f, "LIST", "movi");
+    pos = file_tell(a->f);
+  }
+  if (a->chunk_count == a->chunk_cap) {
+    a->chunk_cap = a->chunk_cap ? a->chunk_cap * 2 : 4096;
+    a->chunks = realloc(a->chunks, a->chunk_cap * sizeof(struct avi_chunk));
+  }
+  struct avi_chunk c = { (uint32_t)(pos - a->movi), size, (uint8_t)stream, (uint8_t)key };
+  a->chunks[a->chunk_count++] = c;
+  if (a->max_chunk[stream] < size) a->max_chunk[stream] = size;
+
+  fwrite(stream ? "01wb" : "00db", 1, 4, a->f);
+  avi_put(a->f, size, 4);
+  if (size) fwrite(data, 1, size, a->f);
+  if (size & 1) fputc(0, a->f);
+}
+
+struct avi *avi_open(const char *path, int w, int h, int ch, int sr, int fps)
+{
+  FILE *f = fopen(path, "wb");
+  if (!f) return NULL;
+  setvbuf(f, NULL, _IOFBF, SINK_CHUNK);
+  struct avi *a = calloc(1, sizeof(struct avi));
+  a->f = f;
+  a->w = w;
+  a->h = h;
+  a->ch = ch;
+  a->sr = sr;
+  a->fps = fps;
+  a->stride = ((size_t)w * 3 + 3) & ~(size_t)3;
+  a->bgr = calloc(a->stride, h);
+  a->riff = avi_begin(f, "RIFF", "AVI ");
+  avi_header(a);
+  a->movi = avi_begin(f, "LIST", "movi");
+  if (a->error) {
+    // Sizes are patched in place, which a pipe cannot take
+    fclose(f);
+    free(a->bgr);
+    free(a);
+    return NULL;
+  }
+  return a;
+}
+
+// Queues mixed audio (zeros when `data` is NULL) for the next chunk
+void avi_audio(struct avi *a, const void *data, size_t size)
+{
+  if (a->audio_fill + size > a->audio_cap) {
+    a->audio_cap = (a->audio_fill + size) * 2;
+    a->audio = realloc(a->audio, a->audio_cap);
+  }
+  if (data) memcpy(a->audio + a->audio_fill, data, size);
+  else memset(a->audio + a->audio_fill, 0, size);
+  a->audio_fill += size;
+}
+
+void avi_flush_audio(struct avi *a, size_t size)
+{
+  if (size > a->audio_fill) size = a->audio_fill;
+  if (size == 0) return;
+  avi_chunk(a, 1, a->audio, (uint32_t)size, 1);
+  a->samples += size / (a->ch * 2);
+  a->riff_samples += size / (a->ch * 2);
+  a->audio_fill -= size;
+  memmove(a->audio, a->audio + size, a->audio_fill);
+}
+
+// Writes one video frame, an empty chunk when `rgb` is NULL, followed by
+// the audio mixed so far
+void avi_frame(struct avi *a, const uint8_t *rgb)
+{
+  if (rgb) {
+    for (int y = 0; y < a->h; y++) {
+      const uint8_t *src = rgb + (size_t)(a->h - 1 - y) * a->w * 3;
+      uint8_t *dst = a->bgr + (size_t)y * a->stride;
+      for (int x = 0; x < a->w; x++) {
+        dst[x*3] = src[x*3+2];
+        dst[x*3+1] = src[x*3+1];
+        dst[x*3+2] = src[x*3];
+      }
+    }
+    avi_chunk(a, 0, a->bgr, (uint32_t)(a->stride * a->h), 1);
+  } else {
+    avi_chunk(a, 0, NULL, 0, 0);
+  }
+  a->frames++;
+  a->riff_frames++;
+  avi_flush_audio(a, a->audio_fill);
+}
+
+// Writes out audio left after the last frame a frame's worth per chunk,
+// then the indexes and the final header. Returns the errno of the first
+// write or seek that failed, 0 when the file is complete.
+int avi_close(struct avi *a)
+{
+  size_t per_frame = (size_t)(a->sr / a->fps) * a->ch * 2;
+  while (a->audio_fill > 0) avi_flush_audio(a, per_frame);
+  avi_end_riff(a);
+  long long end = file_tell(a->f);
+  if (end < 0 || file_seek(a->f, 12, SEEK_SET) != 0) {
+    if (!a->error) a->error = errno;
+  } else {
+    avi_header(a);
+    if (file_seek(a->f, end, SEEK_SET) != 0 && !a->error) a->error = errno;
+  }
+  if ((fflush(a->f) != 0 || ferror(a->f)) && !a->error) a->error = errno ? errno : EIO;
+  if (fclose(a->f) != 0 && !a->error) a->error = errno;
+  int error = a->error;
+  free(a->bgr);
+  free(a->audio);
+  free(a->chunks);
+  free(a);
+  return error;
+}
+
+// Repeat-aware video (--bgv), read back by bga_expand. Each composed
+// frame is stored once and the frames repeating it as a count; an index
+// of stored frames ends the file for seeking. Little-endian throughout:
+//   header   "BGAV" u16 version, u16 format (0 rgb24, 1 Y4M 4:4:4),
+//            u32 width, height, fps
+//   records  "FRAM" and the frame's pixels, or "REPT" u32 count
+//   index    "BGIX" u32 entries, u64 frames, then u64 frame and offset
+//            of each FRAM record
+//   trailer  u64 offset of the index, "BGVE"
+#define BGV_VERSION 1
+
+struct bgv {
+  struct sink *out;
+  size_t frame_size;
+  long long pos, frames;
+  uint32_t repeats;
+  long long *index;
+  int index_count, index_cap;
+};
+
+void bgv_put(struct bgv *b, const void *data, size_t size)
+{
+  sink_raw(b->out, data, size);
+  b->pos += size;
+}
+
+void bgv_open(struct bgv *b, struct sink *out, int w, int h, int fps, int format)
+{
+  uint8_t head[20];
+  memcpy(head, "BGAV", 4);
+  put_le(head + 4, BGV_VERSION, 2);
+  put_le(head + 6, format, 2);
+  put_le(head + 8, w, 4);
+  put_le(head + 12, h, 4);
+  put_le(head + 16, fps, 4);
+  memset(b, 0, sizeof *b);
+  b->out = out;
+  b->frame_size = (size_t)w * h * 3;
+  bgv_put(b, head, sizeof head);
+}
+
+void bgv_repeats(struct bgv *b)
+{
+  if (!b->repeats) return;
+  uint8_t r[8];
+  memcpy(r, "REPT", 4);
+  put_le(r + 4, b->repeats, 4);
+  bgv_put(b, r, sizeof r);
+  b->repeats = 0;
+}
+
+// Appends a frame; NULL repeats the last one stored
+void bgv_frame(struct bgv *b, const uint8_t *pixels)
+{
+  b->frames++;
+  if (!pixels) {
+    if (++b->repeats == 0xFFFFFFFFu) bgv_repeats(b);
+    return;
+  }
+  bgv_repeats(b);
+  if (b->index_count == b->index_cap) {
+    b->index_cap = b->index_cap ? b->index_cap * 2 : 1024;
+    b->index = realloc(b->index, b->index_cap * 2 * sizeof(long long));
+  }
+  b->index[b->index_count * 2] = b->frames - 1;
+  b->index[b->index_count * 2 + 1] = b->pos;
+  b->index_count++;
+  bgv_put(b, "FRAM", 4);
+  bgv_put(b, pixels, b->frame_size);
+}
+
+void bgv_close(struct bgv *b)
+{
+  bgv_repeats(b);
+  long long at = b->pos;
+  uint8_t e[16];
+  memcpy(e, "BGIX", 4);
+  put_le(e + 4, b->index_count, 4);
+  put_le(e + 8, (uint32_t)b->frames, 4);
+  put_le(e + 12, (uint32_t)(b->frames >> 32), 4);
+  bgv_put(b, e, 16);
+  for (int i = 0; i < b->index_count * 2; i++) {
+    put_le(e, (uint32_t)b->index[i], 4);
+    put_le(e + 4, (uint32_t)(b->index[i] >> 32), 4);
+    bgv_put(b, e, 8);
+  }
+  put_le(e, (uint32_t)at, 4);
+  put_le(e + 4, (uint32_t)(at >> 32), 4);
+  memcpy(e + 8, "BGVE", 4);
+  bgv_put(b, e, 12);
+  free(b->index);
+}
 
-#define STB_VORBIS_HEADER_ONLY
-#include "stb_vorbis.c"
-#define MINIAUDIO_IMPLEMENTATION
-#include "miniaudio.h"
+// Headers that open a video or an audio stream
+void video_begin(struct sink *s, struct bgv *bgv, int use_bgv, int y4m,
+  int w, int h, double fps)
+{
+  if (use_bgv) {
+    bgv_open(bgv, s, w, h, (int)fps, y4m);
+  } else if (y4m) {
+    char head[128];
+    y4m_header(head, w, h, fps);
+    sink_raw(s, head, strlen(head));
+  }
+}
 
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+void audio_begin(struct sink *s, int wav, int ch, int sr, long long frames)
+{
+  if (wav) {
+    uint8_t head[80];
+    sink_raw(s, head, wav_format(head, ch, sr, frames));
+  }
+}
 
-#ifdef _WIN32
-#include <io.h>
-#include <fcntl.h>
-#endif
+// Progress records (--progress <fd>) in the key=value form of ffmpeg's
+// -progress, one block every half second and a last one at the end, so a
+// wrapper or scheduler can follow and time out a render. Times are the
+// media time covered by every stream still being rendered.
+#define PROGRESS_INTERVAL 0.5
 
-static const char *img_exts[] = {
-  ".bmp", ".png", ".jpg", ".jpeg", ".gif",
-  ".BMP", ".PNG", ".JPG", ".JPEG", ".GIF"
+struct progress {
+  FILE *f;
+  ma_timer timer;
+  double next;
+  const char *stage;
+  int video, audio, sr;
+  double fps;
+  long long frames, frames_total, samples, samples_total;
 };
 
-char *read_file(const char *path)
+void progress_report(struct progress *p, int end)
 {
-  FILE *f = fopen(path, "rb");
-  if (!f) return NULL;
-  char *buf = NULL;
-  fseek(f, 0, SEEK_END);
-  long len = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  if (len > 0) {
-    buf = malloc(len);
-    if (buf) fread(buf, len, 1, f);
+  double t = ma_timer_get_time_in_seconds(&p->timer);
+  double vt = p->video ? p->frames_total / p->fps : 0.0;
+  double at = p->audio ? (double)p->samples_total / p->sr : 0.0;
+  double total = vt > at ? vt : at, done = total;
+  if (p->video && p->frames < p->frames_total && p->frames / p->fps < done)
+    done = p->frames / p->fps;
+  if (p->audio && p->samples < p->samples_total && (double)p->samples / p->sr < done)
+    done = (double)p->samples / p->sr;
+  fprintf(p->f, "stage=%s\nframes=%lld\nframes_total=%lld\nsamples=%lld\n"
+    "samples_total=%lld\ntime_ms=%lld\ntotal_ms=%lld\n",
+    end ? "end" : p->stage, p->frames, p->frames_total, p->samples,
+    p->samples_total, (long long)(done * 1000.0), (long long)(total * 1000.0));
+  // Throughput of each stream being rendered: frames and samples per second
+  if (p->video) fprintf(p->f, "fps=%.1f\n", t > 0.0 ? p->frames / t : 0.0);
+  if (p->audio) fprintf(p->f, "sps=%.0f\n", t > 0.0 ? p->samples / t : 0.0);
+  if (t > 0.0 && done > 0.0) {
+    double speed = done / t;
+    fprintf(p->f, "speed=%.2fx\nelapsed=%.2f\neta=%.2f\n", speed, t,
+      (total - done) / speed);
+  } else {
+    fprintf(p->f, "speed=N/A\nelapsed=%.2f\neta=N/A\n", t);
   }
-  fclose(f);
-  return buf;
+  fprintf(p->f, "progress=%s\n", end ? "end" : "continue");
+  fflush(p->f);
 }
 
-char *strdupcat(const char *a, const char *b)
+void progress_tick(struct progress *p)
 {
-  if (!a) return strdup(b);
-  size_t la = strlen(a), lb = strlen(b);
-  char *r = malloc(la + lb + 1);
-  memcpy(r, a, la);
-  memcpy(r + la, b, lb);
-  r[la + lb] = 0;
-  return r;
+  if (!p || !p->f) return;
+  double t = ma_timer_get_time_in_seconds(&p->timer);
+  if (t < p->next) return;
+  p->next = t + PROGRESS_INTERVAL;
+  progress_report(p, 0);
 }
 
-char *strdupcat3(const char *a, const char *b, const char *c)
+// Renders fixed-size blocks through scratch buffers allocated once;
+// voices started mid-block carry a negative cursor as their offset.
+// With stems, each voice is summed on the bus of its stem and bus 0
+// carries the sum of all of them; each bus is written to its own sink.
+struct mixer {
+  int ch, buses;
+  int32_t *bus;
+  int16_t *out;
+  struct sink *sinks;
+  long long samples;
+  struct headroom *headroom;
+  struct progress *progress;
+};
+
+void mixer_init(struct mixer *m, int ch, int buses, struct sink *sinks)
 {
-  size_t la = a ? strlen(a) : 0;
-  size_t lb = strlen(b);
-  size_t lc = strlen(c);
-  char *r = malloc(la + lb + lc + 1);
-  if (a) memcpy(r, a, la);
-  memcpy(r + la, b, lb);
-  memcpy(r + la + lb, c, lc);
-  r[la + lb + lc] = 0;
+  m->ch = ch;
+  m->buses = buses;
+  m->bus = ma_aligned_malloc(MIX_BLOCK * ch * buses * sizeof(int32_t), 64, NULL);
+  m->out = ma_aligned_malloc(MIX_BLOCK * ch * sizeof(int16_t), 64, NULL);
+  m->sinks = sinks;
+  m->samples = 0;
+  m->headroom = NULL;
+  m->progress = NULL;
+}
+
+void mixer_free(struct mixer *m)
+{
+  ma_aligned_free(m->bus, NULL);
+  ma_aligned_free(m->out, NULL);
+}
+
+void mixer_block(struct mixer *m, struct voices *vs, struct bank *bank, int ns)
+{
+  int ch = m->ch;
+  int n = ns * ch;
+  int audible = 0, from, to;
+  for (int i = 0; i < vs->count && !audible; i++)
+    audible = voice_window(&vs->v[i], ns, &from, &to);
+  if (!audible) {
+    // Nothing to sum, clamp or pack: every bus is silent for this block
+    for (int i = 0; i < vs->count; i++) vs->v[i].ptr += ns;
+    voices_drop_ended(vs, bank);
+    for (int b = 0; b < m->buses; b++)
+      sink_zero(&m->sinks[b], n * sizeof(int16_t));
+    if (m->headroom) headroom_peak(m->headroom, 0);
+    m->samples += ns;
+    return;
+  }
+  for (int b = 0; b < m->buses; b++)
+    memset(m->bus + b * MIX_BLOCK * ch, 0, n * sizeof(int32_t));
+  for (int i = 0; i < vs->count; i++) {
+    mix_wave(m->bus + vs->v[i].bus * MIX_BLOCK * ch, &vs->v[i], ns, ch);
+    vs->v[i].ptr += ns;
+  }
+  voices_drop_ended(vs, bank);
+  for (int b = 1; b < m->buses; b++) {
+    const int32_t *stem = m->bus + b * MIX_BLOCK * ch;
+    for (int k = 0; k < n; k++) m->bus[k] += stem[k];
+  }
+  if (m->headroom) headroom_block(m->headroom, m->bus, ns, m->samples);
+  for (int b = 0; b < m->buses; b++) {
+    mix_pack(m->out, m->bus + b * MIX_BLOCK * ch, n);
+    sink_write(&m->sinks[b], m->out, n * sizeof(int16_t));
+  }
+  m->samples += ns;
+}
+
+// Mixes every block that ends at or before `pos`, leaving a partial block
+void mixer_run(struct mixer *m, struct voices *vs, struct bank *bank, long long pos)
+{
+  while (m->samples + MIX_BLOCK <= pos) {
+    mixer_block(m, vs, bank, MIX_BLOCK);
+    if (m->progress) {
+      m->progress->samples = m->samples;
+      progress_tick(m->progress);
+    }
+  }
+}
+
+void mixer_finish(struct mixer *m, struct voices *vs, struct bank *bank, long long end)
+{
+  mixer_run(m, vs, bank, end);
+  if (m->samples < end) mixer_block(m, vs, bank, (int)(end - m->samples));
+  if (m->progress) m->progress->samples = m->samples;
+}
+
+// Index of the first tick of a clock at `rate` that is not before `t`
+long long clock_index(double t, double rate)
+{
+  return (long long)ceil(t * rate - 1e-6);
+}
+
+// Output-clock positions of every event, computed once from the tempo map.
+// Time is re-anchored at each tempo change instead of being accumulated
+// per event, so rounding error does not build up over long charts.
+struct cue { long long sample, frame; };
+
+struct cue *schedule(const struct bm_seq *seq, double tempo, int sr, double fps)
+{
+  struct cue *cues = malloc((seq->event_count + 1) * sizeof(struct cue));
+  double seg_time = 0.0;
+  int seg_pos = 0;
+  for (int i = 0; i < seq->event_count; i++) {
+    struct bm_event ev = seq->events[i];
+    double t = seg_time + (ev.pos - seg_pos) * (60.0 / 48.0 / tempo);
+    cues[i].sample = clock_index(t, sr);
+    cues[i].frame = clock_index(t, fps);
+    if (ev.type == BM_TEMPO_CHANGE) {
+      seg_time = t;
+      seg_pos = ev.pos;
+      tempo = ev.value_f;
+    }
+  }
+  return cues;
+}
+
+// Stem 0 holds background (BGM) channels, then one stem per object lane
+// that has notes; stem k is mixed on bus k + 1
+#define STEMS_MAX 64
+
+struct stems {
+  int count;
+  int of_track[STEMS_MAX];
+  char names[STEMS_MAX][8];
+};
+
+int stem_track(int track)
+{
+  return track <= 0 ? 0 : track;
+}
+
+int stem_bus(const struct stems *st, int track)
+{
+  return st->count ? 1 + st->of_track[stem_track(track)] : 0;
+}
+
+void stems_init(struct stems *st, const struct bm_seq *seq)
+{
+  int used[STEMS_MAX] = {0};
+  for (int i = 0; i < seq->event_count; i++) {
+    struct bm_event ev = seq->events[i];
+    if (ev.type == BM_NOTE || ev.type == BM_NOTE_LONG)
+      used[stem_track(ev.track)] = 1;
+  }
+  st->count = 1;
+  strcpy(st->names[0], "bgm");
+  for (int t = 1; t < STEMS_MAX; t++) {
+    if (!used[t]) continue;
+    st->of_track[t] = st->count;
+    sprintf(st->names[st->count++], "%02d", t);
+  }
+}
+
+// The tail is held until the first video frame boundary after the last
+// voice ends
+long long audio_end(long long last_event, long long last_voice, int sr, double fps)
+{
+  if (last_voice <= last_event) return last_event;
+  long long f = clock_index((double)last_voice / sr, fps);
+  long long end = clock_index(f / fps, sr);
+  if (end < last_voice) end = clock_index((f + 1) / fps, sr);
+  return end;
+}
+
+// Runs the voice limit over every trigger without mixing, giving the
+// exact span each voice sounds for in the serial render
+struct take *plan_takes(const struct bm_seq *seq, const struct cue *cues,
+  struct wave *waves, const struct stems *stems, struct voices *vs, int *count)
+{
+  struct take *takes = malloc((seq->event_count + 1) * sizeof(struct take));
+  struct bank none = {0};
+  long long now = 0;
+  int n = 0;
+  for (int i = 0; i < seq->event_count; i++) {
+    struct bm_event ev = seq->events[i];
+    if (ev.type != BM_NOTE && ev.type != BM_NOTE_LONG) continue;
+    for (int j = 0; j < vs->count; j++)
+      vs->v[j].ptr += (int)(cues[i].sample - now);
+    voices_drop_ended(vs, &none);
+    now = cues[i].sample;
+    takes[n].start = now;
+    voice_start(vs, &none, &waves[ev.value], 0, stem_bus(stems, ev.track), &takes[n]);
+    n++;
+  }
+  *count = n;
+  return takes;
+}
+
+// Segmented output (--segment-seconds): both streams are cut at the same
+// frames into numbered files, each listed with its duration in an ffconcat
+// manifest, so that segments can be encoded apart and joined. A cut moves
+// to a picture change near it where there is one, since an encoder puts a
+// keyframe there anyway. Audio past the last frame stays in the last
+// segment.
+struct split {
+  // First frame of each segment, then the end
+  long long *cuts;
+  int count;
+  // Segment being written, template and manifest for video and audio
+  int at[2];
+  const char *path[2];
+  FILE *manifest[2];
+  double fps;
+  int sr, ch, w, h;
+  int y4m, wav, bgv, direct;
+  size_t frame_bytes;
+  long long samples;
+};
+
+// `path` with the segment number before its extension, or with the
+// extension replaced by .ffconcat for the manifest when `k` < 0
+char *split_name(const char *path, int k)
+{
+  const char *base = path;
+  for (const char *p = path; *p; p++)
+    if (*p == '/' || *p == '\\') base = p + 1;
+  const char *dot = strrchr(base, '.');
+  size_t stem = dot && dot != base ? (size_t)(dot - path) : strlen(path);
+  char *r = malloc(stem + 16 + strlen(path + stem));
+  memcpy(r, path, stem);
+  if (k < 0) strcpy(r + stem, ".ffconcat");
+  else sprintf(r + stem, "_%04d%s", k, path + stem);
   return r;
 }
 
+void split_plan(struct split *sg, const struct bm_seq *seq,
+  const struct cue *cues, long long end, long long len)
+{
+  int cap = 16;
+  sg->cuts = malloc(cap * sizeof(long long));
+  sg->cuts[0] = 0;
+  sg->count = 1;
+  while (end - sg->cuts[sg->count - 1] > len) {
+    long long at = sg->cuts[sg->count - 1], target = at + len;
+    long long cut = target, best = len / 4 + 1;
+    for (int i = 0; i < seq->event_count; i++) {
+      long long f = cues[i].frame, d = f > target ? f - target : target - f;
+      if ((seq->events[i].type == BM_BGA_BASE_CHANGE ||
+          seq->events[i].type == BM_BGA_LAYER_CHANGE) && f > at && f < end && d < best) {
+        best = d;
+        cut = f;
+      }
+    }
+    if (sg->count + 1 == cap) {
+      cap *= 2;
+      sg->cuts = realloc(sg->cuts, cap * sizeof(long long));
+    }
+    sg->cuts[sg->count++] = cut;
+  }
+  sg->cuts[sg->count] = end;
+}
+
+long long split_sample(const struct split *sg, int k)
+{
+  return k >= sg->count ? sg->samples : clock_index(sg->cuts[k] / sg->fps, sg->sr);
+}
+
+void split_list(struct split *sg, int stream, int k)
+{
+  char *name = split_name(sg->path[stream], k);
+  const char *base = name;
+  for (const char *p = name; *p; p++)
+    if (*p == '/' || *p == '\\') base = p + 1;
+  double d = stream ?
+    (double)(split_sample(sg, k + 1) - split_sample(sg, k)) / sg->sr :
+    (sg->cuts[k + 1] - sg->cuts[k]) / sg->fps;
+  fprintf(sg->manifest[stream], "file '%s'\nduration %.6f\n", base, d);
+  free(name);
+}
+
+// Opens segment `k` of a stream and writes its header
+void split_open(struct split *sg, int stream, int k, struct sink *s, struct bgv *bgv)
+{
+  char *name = split_name(sg->path[stream], k);
+  long long frames = stream ? split_sample(sg, k + 1) - split_sample(sg, k) :
+    sg->cuts[k + 1] - sg->cuts[k];
+  long long size = stream ? 80 + frames * sg->ch * (long long)sizeof(int16_t) :
+    sg->bgv ? 0 : 64 + frames * (long long)sg->frame_bytes;
+  if (!sink_create(s, name, size, sg->direct)) {
+    fprintf(stderr, "Cannot write %s\n", name);
+    exit(1);
+  }
+  free(name);
+  sg->at[stream] = k;
+  if (!stream) {
+    video_begin(s, bgv, sg->bgv, sg->y4m, sg->w, sg->h, sg->fps);
+    return;
+  }
+  audio_begin(s, sg->wav, sg->ch, sg->sr, frames);
+  // The last segment takes whatever audio remains
+  if (k + 1 < sg->count) {
+    s->split = sg;
+    s->left = frames * sg->ch * (long long)sizeof(int16_t);
+  }
+}
+
+// Closes the segment a sink is writing and opens the next one, keeping
+// what the sink carries across files
+void split_next(struct split *sg, int stream, struct sink *s, struct bgv *bgv)
+{
+  if (!stream && sg->bgv) bgv_close(bgv);
+  struct sink next = {0};
+  next.meter = s->meter;
+  next.writer = s->writer;
+  next.zeros = s->zeros;
+  if (!sink_finish(s) || (s->f && fclose(s->f) != 0)) {
+    char *name = split_name(sg->path[stream], sg->at[stream]);
+    fprintf(stderr, "Cannot write %s: %s\n", name, strerror(s->error ? s->error : errno));
+    exit(1);
+  }
+  split_list(sg, stream, sg->at[stream]);
+  *s = next;
+  split_open(sg, stream, sg->at[stream] + 1, s, bgv);
+}
+
+void split_next_audio(struct sink *s)
+{
+  split_next(s->split, 1, s, NULL);
+}
+
+// Lists the last segment of each stream and closes the manifests
+void split_close(struct split *sg)
+{
+  for (int stream = 0; stream < 2; stream++) {
+    if (!sg->manifest[stream]) continue;
+    split_list(sg, stream, sg->at[stream]);
+    fclose(sg->manifest[stream]);
+  }
+  free(sg->cuts);
+}
+
+// One time range of the render, mixed on its own from the takes that
+// overlap it into one memory buffer per bus
+struct segment {
+  const struct take *takes;
+  int take_count;
+  int ch, buses;
+  long long from, to;
+  int16_t **pcm;
+  struct headroom *headroom;
+  ma_thread thread;
+  int threaded;
+};
+
+ma_thread_result MA_THREADCALL render_segment(void *data)
+{
+  struct segment *sg = data;
+  struct voices vs = {0};
+  struct bank none = {0};
+  for (int i = 0; i < sg->take_count && sg->takes[i].start < sg->to; i++) {
+    const struct take *t = &sg->takes[i];
+    if (t->start + t->stop <= sg->from) continue;
+    struct voice v = { t->w, (int)(sg->from - t->start), t->stop, t->bus, NULL };
+    voices_push(&vs, v);
+  }
+
+  struct sink *sinks = calloc(sg->buses, sizeof(struct sink));
+  for (int b = 0; b < sg->buses; b++) sinks[b].mem = (uint8_t *)sg->pcm[b];
+  struct mixer m;
+  mixer_init(&m, sg->ch, sg->buses, sinks);
+  m.samples = sg->from;
+  m.headroom = sg->headroom;
+  mixer_finish(&m, &vs, &none, sg->to);
+  mixer_free(&m);
+  free(sinks);
+  free(vs.v);
+  return (ma_thread_result)0;
+}
+
+#define SEGMENT_SECONDS 10
+
+// Mixes `jobs` segments at a time and writes them out in order, adding
+// their statistics to `headroom` when it is set and counting written
+// segments in `progress`. Segments are whole mixer blocks long so that
+// blocks fall exactly where a serial render puts them.
+void render_parallel(const struct take *takes, int take_count, long long end,
+  int ch, int sr, int buses, struct sink *sinks, int jobs, struct headroom *headroom,
+  struct progress *progress)
+{
+  long long len = (long long)sr * SEGMENT_SECONDS / MIX_BLOCK * MIX_BLOCK;
+  struct segment *sg = calloc(jobs, sizeof(struct segment));
+  for (int k = 0; k < jobs; k++) {
+    sg[k].takes = takes;
+    sg[k].take_count = take_count;
+    sg[k].ch = ch;
+    sg[k].buses = buses;
+    if (headroom) {
+      sg[k].headroom = malloc(sizeof(struct headroom));
+      headroom_init(sg[k].headroom, ch, sr);
+    }
+    sg[k].pcm = malloc(buses * sizeof(int16_t *));
+    for (int b = 0; b < buses; b++)
+      sg[k].pcm[b] = malloc(len * ch * sizeof(int16_t));
+  }
+
+  for (long long pos = 0; pos < end; pos += len * jobs) {
+    int k;
+    for (k = 0; k < jobs && pos + k * len < end; k++) {
+      sg[k].from = pos + k * len;
+      sg[k].to = sg[k].from + len < end ? sg[k].from + len : end;
+      sg[k].threaded = ma_thread_create(&sg[k].thread, ma_thread_priority_normal,
+        0, render_segment, &sg[k], NULL) == MA_SUCCESS;
+      if (!sg[k].threaded) render_segment(&sg[k]);
+    }
+    for (int j = 0; j < k; j++) {
+      if (sg[j].threaded) ma_thread_wait(&sg[j].thread);
+      if (headroom) {
+        headroom_merge(headroom, sg[j].headroom);
+        free(sg[j].headroom->second);
+        headroom_init(sg[j].headroom, ch, sr);
+      }
+      for (int b = 0; b < buses; b++)
+        sink_write_sparse(&sinks[b], sg[j].pcm[b],
+          (sg[j].to - sg[j].from) * ch * sizeof(int16_t));
+      progress->samples = sg[j].to;
+      progress_tick(progress);
+    }
+  }
+
+  for (int k = 0; k < jobs; k++) {
+    for (int b = 0; b < buses; b++) free(sg[k].pcm[b]);
+    free(sg[k].pcm);
+    free(sg[k].headroom);
+  }
+  free(sg);
+}
+
+// Composes the layer over the base; black layer pixels are transparent.
+// `step` > 1 point-samples the source for reduced-size output.
+void compose_frame(uint8_t *out, const uint8_t *bg, const uint8_t *fg,
+  int bw, int ow, int oh, int step)
+{
+  for (int y = 0; y < oh; y++)
+    for (int x = 0; x < ow; x++) {
+      size_t p = ((size_t)y * step * bw + (size_t)x * step) * 3;
+      uint8_t *pix = out + ((size_t)y * ow + x) * 3;
+      memset(pix, 0, 3);
+      if (bg) memcpy(pix, bg + p, 3);
+      if (fg) {
+        const uint8_t *f = fg + p;
+        if (f[0] || f[1] || f[2])
+          memcpy(pix, f, 3);
+      }
+    }
+}
+
+// Scene list (--scenes <prefix>): each distinct pairing of base and layer
+// is composed once into <prefix>NNNN.ppm, and <prefix>list.ffconcat gives
+// the scenes in order with their durations for ffmpeg's concat demuxer.
+// Scenes start and end on the frames where the video would change, and
+// durations are taken between boundaries rounded to microseconds so that
+// they add up without drift.
+struct scenes {
+  const char *prefix;
+  FILE *list;
+  // Base and layer of each image written so far
+  int *keys;
+  int count, cap;
+  // Composition on screen since frame `start`
+  int bg, fg;
+  long long start;
+  // Scene waiting to be listed, extended while the same image follows
+  int image;
+  long long from, to;
+  long long listed;
+  // What compose_frame needs
+  uint8_t **bitmaps;
+  uint8_t *frame;
+  int bw, ow, oh, step;
+  double fps;
+};
+
+int scenes_open(struct scenes *sc, const char *prefix)
+{
+  char *path = strdupcat(prefix, "list.ffconcat");
+  sc->list = fopen(path, "w");
+  if (!sc->list) {
+    fprintf(stderr, "Cannot write %s\n", path);
+    free(path);
+    return 0;
+  }
+  free(path);
+  fprintf(sc->list, "ffconcat version 1.0\n");
+  sc->prefix = prefix;
+  sc->bg = sc->fg = -1;
+  sc->image = -1;
+  return 1;
+}
+
+// Image showing the current composition, composed and written the first
+// time it is needed
+int scenes_image(struct scenes *sc)
+{
+  for (int k = 0; k < sc->count; k++)
+    if (sc->keys[k * 2] == sc->bg && sc->keys[k * 2 + 1] == sc->fg) return k;
+  if (sc->count == sc->cap) {
+    sc->cap = sc->cap ? sc->cap * 2 : 64;
+    sc->keys = realloc(sc->keys, sc->cap * 2 * sizeof(int));
+  }
+  int k = sc->count++;
+  sc->keys[k * 2] = sc->bg;
+  sc->keys[k * 2 + 1] = sc->fg;
+  compose_frame(sc->frame, sc->bg >= 0 ? sc->bitmaps[sc->bg] : NULL,
+    sc->fg >= 0 ? sc->bitmaps[sc->fg] : NULL, sc->bw, sc->ow, sc->oh, sc->step);
+  char name[16];
+  sprintf(name, "%04d.ppm", k);
+  char *path = strdupcat(sc->prefix, name);
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Cannot write %s\n", path);
+    exit(1);
+  }
+  fprintf(f, "P6\n%d %d\n255\n", sc->ow, sc->oh);
+  fwrite(sc->frame, 1, (size_t)sc->ow * sc->oh * 3, f);
+  fclose(f);
+  free(path);
+  return k;
+}
+
+// Writes the waiting scene into the list
+void scenes_list(struct scenes *sc)
+{
+  if (sc->image < 0) return;
+  const char *base = sc->prefix;
+  for (const char *p = sc->prefix; *p; p++)
+    if (*p == '/' || *p == '\\') base = p + 1;
+  long long fps = (long long)sc->fps;
+  long long from = (sc->from * 1000000 + fps / 2) / fps;
+  long long to = (sc->to * 1000000 + fps / 2) / fps;
+  fprintf(sc->list, "file '%s%04d.ppm'\nduration %lld.%06lld\n", base, sc->image,
+    (to - from) / 1000000, (to - from) % 1000000);
+  sc->listed++;
+}
+
+// Ends the composition on screen at frame `end`
+void scenes_cut(struct scenes *sc, long long end)
+{
+  if (end <= sc->start) return;
+  int k = scenes_image(sc);
+  if (k != sc->image) {
+    scenes_list(sc);
+    sc->image = k;
+    sc->from = sc->start;
+  }
+  sc->to = end;
+  sc->start = end;
+}
+
+// Puts base `bg` and layer `fg` on screen from frame `at`
+void scenes_show(struct scenes *sc, int bg, int fg, long long at)
+{
+  if (bg == sc->bg && fg == sc->fg) return;
+  scenes_cut(sc, at);
+  sc->bg = bg;
+  sc->fg = fg;
+}
+
+// Ends the list at frame `end`. The last file is named again, as the
+// concat demuxer otherwise drops the duration of the final entry.
+void scenes_close(struct scenes *sc, long long end)
+{
+  const char *base = sc->prefix;
+  for (const char *p = sc->prefix; *p; p++)
+    if (*p == '/' || *p == '\\') base = p + 1;
+  scenes_cut(sc, end);
+  int last = sc->image;
+  scenes_list(sc);
+  if (last >= 0) fprintf(sc->list, "file '%s%04d.ppm'\n", base, last);
+  fclose(sc->list);
+  free(sc->keys);
+}
+
+int cpu_count(void)
+{
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return (int)si.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif
+}
+
 int main(int argc, char **argv)
 {
 #ifdef _WIN32
@@ -72,13 +2759,117 @@ int main(int argc, char **argv)
 
   int arg = 1;
   int is_video = 1;
-  if (arg < argc && argv[arg][0] == '-') {
-    if (argv[arg][1] == 'a') is_video = 0;
-    arg++;
+  struct bank bank = {0};
+  bank.worst_snr = INFINITY;
+  struct voices voices = {0};
+  voices.cap = 256;
+  const char *simd = NULL;
+  int jobs = 1;
+  const char *stems_prefix = NULL;
+  const char *report_path = NULL;
+  int draft = 0;
+  const char *out_path = NULL;
+  int direct = 0, splice = 0, y4m = 0, wav = 0, use_avi = 0, use_bgv = 0;
+  int sync_io = 0, progress_fd = -1;
+  double segment_seconds = 0.0;
+  const char *av_video = NULL, *av_audio = NULL;
+  const char *scenes_prefix = NULL;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "--bank") == 0 && arg + 1 < argc) {
+      bank.enabled = 1;
+      bank.cap = (size_t)atoi(argv[++arg]) << 20;
+    } else if (strcmp(argv[arg], "--voices") == 0 && arg + 1 < argc) {
+      voices.cap = atoi(argv[++arg]);
+      if (voices.cap < 1) voices.cap = 1;
+    } else if (strcmp(argv[arg], "--steal") == 0 && arg + 1 < argc) {
+      const char *p = argv[++arg];
+      int k = 0;
+      while (k < 3 && strcmp(p, steal_names[k]) != 0) k++;
+      if (k == 3) { arg = argc; break; }
+      voices.policy = (enum steal_policy)k;
+    } else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+      jobs = atoi(argv[++arg]);
+      if (jobs <= 0) jobs = cpu_count();
+    } else if (strcmp(argv[arg], "--stems") == 0 && arg + 1 < argc) {
+      stems_prefix = argv[++arg];
+    } else if (strcmp(argv[arg], "--adpcm") == 0) {
+      bank.adpcm = 1;
+    } else if (strcmp(argv[arg], "--draft") == 0) {
+      draft = 1;
+    } else if (strcmp(argv[arg], "--report") == 0 && arg + 1 < argc) {
+      report_path = argv[++arg];
+    } else if (strcmp(argv[arg], "--simd") == 0 && arg + 1 < argc) {
+      simd = argv[++arg];
+      if (strcmp(simd, "scalar") != 0 && strcmp(simd, "sse2") != 0 &&
+          strcmp(simd, "avx2") != 0) { arg = argc; break; }
+    } else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) {
+      out_path = argv[++arg];
+    } else if (strcmp(argv[arg], "--direct") == 0) {
+      direct = 1;
+    } else if (strcmp(argv[arg], "--splice") == 0) {
+      splice = 1;
+    } else if (strcmp(argv[arg], "--sync-io") == 0) {
+      sync_io = 1;
+    } else if (strcmp(argv[arg], "--progress") == 0 && arg + 1 < argc) {
+      progress_fd = atoi(argv[++arg]);
+    } else if (strcmp(argv[arg], "--segment-seconds") == 0 && arg + 1 < argc) {
+      segment_seconds = atof(argv[++arg]);
+    } else if (strcmp(argv[arg], "--y4m") == 0) {
+      y4m = 1;
+    } else if (strcmp(argv[arg], "--wav") == 0) {
+      wav = 1;
+    } else if (strcmp(argv[arg], "--avi") == 0) {
+      use_avi = 1;
+    } else if (strcmp(argv[arg], "--bgv") == 0) {
+      use_bgv = 1;
+    } else if (strcmp(argv[arg], "--av") == 0 && arg + 2 < argc) {
+      av_video = argv[++arg];
+      av_audio = argv[++arg];
+    } else if (strcmp(argv[arg], "--scenes") == 0 && arg + 1 < argc) {
+      scenes_prefix = argv[++arg];
+    } else if (argv[arg][1] == 'a') is_video = 0;
+    else if (argv[arg][1] == 'v') is_video = 1;
+    else { arg = argc; break; }
+  }
+  // An AVI, or a pair of outputs given with --av, carries both streams
+  // from one walk of the timeline
+  if (use_avi) {
+    y4m = wav = use_bgv = 0;
+    av_video = av_audio = NULL;
+  }
+  if (scenes_prefix && (use_avi || av_video || use_bgv)) {
+    fprintf(stderr, "--scenes replaces the video stream\n");
+    return 1;
+  }
+  if (use_avi || av_video) is_video = 1;
+  int is_audio = !is_video || use_avi || av_video;
+  // A scene list stands in for the video; audio goes to -o alongside it
+  // only when asked for with -a or --wav
+  if (scenes_prefix) {
+    if (wav) is_audio = 1;
+    is_video = 0;
+  }
+  if (use_avi && !out_path) {
+    fprintf(stderr, "--avi needs an output file (-o)\n");
+    return 1;
+  }
+  if (segment_seconds > 0.0 && (use_avi || (!out_path && !av_video))) {
+    fprintf(stderr, "--segment-seconds needs output files (-o or --av)\n");
+    return 1;
+  }
+  if (progress_fd == 1 && !out_path && !av_video) {
+    fprintf(stderr, "--progress 1 needs the output in a file (-o or --av)\n");
+    return 1;
   }
-  int is_audio = !is_video;
   if (arg >= argc) {
-    fprintf(stderr, "Usage: %s [-v|-a] <BMS>\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-v|-a] [--draft] [--bank <MB>] [--adpcm] [--voices <N>]\n"
+      "  [--steal <oldest|quietest|same>] [--jobs <N>] [--stems <prefix>]\n"
+      "  [--report <JSON>] [--simd <scalar|sse2|avx2>] [--y4m] [--wav] [--avi] [--bgv]\n"
+      "  [-o <file> | --av <video> <audio>] [--direct] [--splice] [--sync-io]\n"
+      "  [--progress <fd>] [--segment-seconds <N>] [--scenes <prefix>] <BMS>\n"
+      "Outputs may be files, named pipes or fd:<N> for an inherited descriptor\n"
+      "--splice hands pipe output over with vmsplice; its reader must copy it out\n",
+      argv[0]);
     return 1;
   }
 
@@ -92,7 +2883,7 @@ int main(int argc, char **argv)
   else { free(bms_dir); bms_dir = NULL; }
 
   fprintf(stderr, "Loading chart\n");
-  char *src = read_file(bms_path);
+  char *src = read_file(bms_path, NULL);
   if (!src) {
     fprintf(stderr, "Cannot read %s\n", bms_path);
     return 1;
@@ -106,7 +2897,7 @@ int main(int argc, char **argv)
   int bw = -1, bh = -1;
   uint8_t *bitmaps[BM_INDEX_MAX] = {0};
 
-  if (is_video) {
+  if (is_video || scenes_prefix) {
     fprintf(stderr, "Loading images\n");
     for (int i = 0; i < BM_INDEX_MAX; i++) {
       const char *name = chart.tables.bmp[i];
@@ -155,15 +2946,19 @@ int main(int argc, char **argv)
     ".ogg",".wav",".mp3",".OGG",".WAV",".MP3"
   };
 
-  struct wave { int16_t *pcm; int len, ptr; } waves[BM_INDEX_MAX];
-  for (int i = 0; i < BM_INDEX_MAX; i++) waves[i].ptr = -1;
+  struct wave waves[BM_INDEX_MAX] = {0};
 
-  int ch = 2;
-  int sr = 44100;
+  // Drafts decode and mix at a quarter rate in mono, and render video
+  // at half size and half frame rate
+  int ch = draft ? 1 : 2;
+  int sr = draft ? 11025 : 44100;
+  bank.ch = ch;
+  bank.sr = sr;
+  bank.levels = voices.policy == STEAL_QUIETEST;
 
   if (is_audio) {
     fprintf(stderr, "Loading audio\n");
-    ma_decoder_config cfg = ma_decoder_config_init(ma_format_s16, ch, sr);
+    fprintf(stderr, "Mixer kernels: %s\n", mix_init(simd));
     for (int i = 0; i < BM_INDEX_MAX; i++) {
       if (!chart.tables.wav[i]) continue;
       char base[256];
@@ -174,117 +2969,374 @@ int main(int argc, char **argv)
 
       for (int e = 0; e < 6; e++) {
         char *p = strdupcat3(bms_dir, base, wave_exts[e]);
-        ma_uint64 len;
-        if (ma_decode_file(p, &cfg, &len, (void**)&waves[i].pcm) == MA_SUCCESS) {
-          waves[i].len = (int)len;
-          waves[i].ptr = -1;
+        if (load_wave(p, &bank, &waves[i])) {
           free(p);
           break;
         }
         free(p);
       }
     }
+
+    if (!bank.enabled) {
+      long long total = 0, stored = 0;
+      for (int i = 0; i < BM_INDEX_MAX; i++) {
+        total += waves[i].len;
+        stored += waves[i].span;
+      }
+      if (total > 0)
+        fprintf(stderr, "Trimmed %.1f%% of keysound frames as silence\n",
+          100.0 * (total - stored) / total);
+    }
   }
 
   struct bm_seq seq;
   bm_to_seq(&chart, &seq);
 
-  double fps = 30.0;
-  double time = 0.0;
-  double tempo = chart.meta.init_tempo;
+  double fps = draft ? 15.0 : 30.0;
+  int step = draft ? 2 : 1;
+  int ow = 0, oh = 0;
+  uint8_t *frame = NULL;
+  int dirty = 1, fresh = 0;
+  if (is_video || scenes_prefix) {
+    ow = bw / step > 0 ? bw / step : 1;
+    oh = bh / step > 0 ? bh / step : 1;
+    frame = malloc((size_t)ow * oh * 3);
+    if (draft) fprintf(stderr, "Draft video %dx%d at %g fps\n", ow, oh, fps);
+  }
+  // Y4M frames are converted once per composition and written from here
+  size_t frame_bytes = (size_t)ow * oh * 3;
+  uint8_t *out_frame = frame;
+  if (is_video && y4m) {
+    frame_bytes += 6;
+    out_frame = malloc(frame_bytes);
+    memcpy(out_frame, "FRAME\n", 6);
+  }
+  struct cue *cues = schedule(&seq, chart.meta.init_tempo, sr, fps);
   int bg = -1, fg = -1;
-  int frames = 0;
-  int samples = 0;
+  long long frames = 0;
+
+  struct stems stems = {0};
+  struct sink *sinks = calloc(1 + STEMS_MAX, sizeof(struct sink));
+  // Output lengths follow from the schedule: video runs to the frame of
+  // the last event, audio to where the last voice ends once voice limit
+  // cuts are applied, rounded up to a frame
+  long long last_event = seq.event_count ? cues[seq.event_count - 1].sample : 0;
+  long long audio_frames = 0;
+  if (is_audio && (wav || out_path || av_audio || progress_fd >= 0)) {
+    struct voices plan = {0};
+    plan.cap = voices.cap;
+    plan.policy = voices.policy;
+    int take_count;
+    struct take *takes = plan_takes(&seq, cues, waves, &stems, &plan, &take_count);
+    long long last = 0;
+    for (int i = 0; i < take_count; i++)
+      if (last < takes[i].start + takes[i].stop) last = takes[i].start + takes[i].stop;
+    audio_frames = audio_end(last_event, last, sr, fps);
+    free(takes);
+    free(plan.v);
+  }
+  long long video_bytes = 64 + (seq.event_count ? cues[seq.event_count - 1].frame : 0) *
+    (long long)frame_bytes;
+  if (use_bgv) {
+    // At most one stored frame per picture change
+    long long changes = 1;
+    for (int i = 0; i < seq.event_count; i++)
+      if (seq.events[i].type == BM_BGA_BASE_CHANGE || seq.events[i].type == BM_BGA_LAYER_CHANGE)
+        changes++;
+    video_bytes = 64 + changes * (frame_bytes + 24);
+  }
+  long long audio_bytes = 80 + audio_frames * ch * (long long)sizeof(int16_t);
+  struct sink video = {0};
+  struct avi *avi = NULL;
+  struct bgv bgv;
+  struct split split = {0};
+  if (segment_seconds > 0.0) {
+    split.path[0] = is_video ? (av_video ? av_video : out_path) : NULL;
+    split.path[1] = is_audio ? (av_audio ? av_audio : out_path) : NULL;
+    split.fps = fps;
+    split.sr = sr;
+    split.ch = ch;
+    split.w = ow;
+    split.h = oh;
+    split.y4m = y4m;
+    split.wav = wav;
+    split.bgv = use_bgv;
+    split.direct = direct;
+    split.frame_bytes = frame_bytes;
+    split.samples = audio_frames;
+    long long len = (long long)(segment_seconds * fps + 0.5);
+    split_plan(&split, &seq, cues, is_video ?
+      (seq.event_count ? cues[seq.event_count - 1].frame : 0) :
+      clock_index(audio_frames / (double)sr, fps), len > 0 ? len : 1);
+    for (int k = 0; k < 2; k++) {
+      if (!split.path[k]) continue;
+      char *name = split_name(split.path[k], -1);
+      split.manifest[k] = fopen(name, "w");
+      if (!split.manifest[k]) {
+        fprintf(stderr, "Cannot write %s\n", name);
+        return 1;
+      }
+      fprintf(split.manifest[k], "ffconcat version 1.0\n");
+      free(name);
+    }
+    fprintf(stderr, "Writing %d segments of about %g s\n", split.count, segment_seconds);
+  }
+  const char *failed = NULL;
+  int write_error = 0;
+  if (split.count) {
+    // Segment files are opened once the writer runs
+  } else if (use_avi) {
+    avi = avi_open(out_path, ow, oh, ch, sr, (int)fps);
+    if (!avi) failed = out_path;
+    else sinks[0].avi = avi;
+  } else if (av_video) {
+    if (!sink_create(&video, av_video, video_bytes, direct)) failed = av_video;
+    else if (!sink_create(&sinks[0], av_audio, audio_bytes, direct)) failed = av_audio;
+  } else if (out_path && (is_video || is_audio)) {
+    if (!sink_create(is_video ? &video : &sinks[0], out_path,
+        is_video ? video_bytes : audio_bytes, direct))
+      failed = out_path;
+  } else {
+    sink_open(is_video ? &video : &sinks[0], stdout);
+  }
+  if (failed) {
+    fprintf(stderr, "Cannot write %s\n", failed);
+    return 1;
+  }
+  struct scenes scenes = {0};
+  if (scenes_prefix) {
+    if (!scenes_open(&scenes, scenes_prefix)) return 1;
+    scenes.bitmaps = bitmaps;
+    scenes.frame = frame;
+    scenes.bw = bw;
+    scenes.ow = ow;
+    scenes.oh = oh;
+    scenes.step = step;
+    scenes.fps = fps;
+  }
+  if (splice) {
+    sink_pipe(&video);
+    sink_pipe(&sinks[0]);
+  }
+  // Output is written on its own thread unless asked not to; AVI frames
+  // are written directly and stay in order with their audio that way
+  struct writer *writer = sync_io || avi ? NULL : writer_start();
+  video.writer = writer;
+  for (int b = 0; b < 1 + STEMS_MAX; b++) sinks[b].writer = writer;
+  if (split.count) {
+    if (is_video) split_open(&split, 0, 0, &video, &bgv);
+    if (is_audio) split_open(&split, 1, 0, &sinks[0], NULL);
+  } else {
+    if (is_video) video_begin(&video, &bgv, use_bgv, y4m, ow, oh, fps);
+    if (is_audio) audio_begin(&sinks[0], wav, ch, sr, audio_frames);
+  }
+  if (is_audio && stems_prefix) {
+    stems_init(&stems, &seq);
+    for (int k = 0; k < stems.count; k++) {
+      char name[16];
+      sprintf(name, "%s.wav", stems.names[k]);
+      char *path = strdupcat(stems_prefix, name);
+      FILE *f = fopen(path, "wb");
+      if (!f) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return 1;
+      }
+      wav_header(f, ch, sr, 0);
+      sink_open(&sinks[1 + k], f);
+      free(path);
+    }
+    fprintf(stderr, "Writing %d stems to %s*.wav\n", stems.count, stems_prefix);
+  }
+  int buses = stems.count ? 1 + stems.count : 1;
+  struct meter meter;
+  struct headroom headroom;
+  if (is_audio && report_path) {
+    meter_init(&meter, ch, sr);
+    headroom_init(&headroom, ch, sr);
+    sinks[0].meter = &meter;
+  }
+  struct mixer mixer;
+  if (is_audio) {
+    mixer_init(&mixer, ch, buses, sinks);
+    if (report_path) mixer.headroom = &headroom;
+  }
+
+  if (is_audio && jobs > 1 && bank.enabled) {
+    fprintf(stderr, "Bank mode decodes on trigger, rendering serially\n");
+    jobs = 1;
+  }
+  // Both streams advance together, so audio is mixed frame by frame
+  int together = is_video && is_audio;
+  if (jobs > 1 && together) {
+    fprintf(stderr, "Audio is interleaved with the frames, rendering serially\n");
+    jobs = 1;
+  }
+  int parallel = is_audio && jobs > 1;
+  ma_timer timer;
+  ma_timer_init(&timer);
+
+  struct progress progress = {0};
+  if (progress_fd >= 0) {
+    progress.f = progress_fd == 1 ? stdout : progress_fd == 2 ? stderr :
+      fdopen(progress_fd, "w");
+    if (!progress.f) fprintf(stderr, "Cannot write progress to fd %d\n", progress_fd);
+  }
+  ma_timer_init(&progress.timer);
+  progress.stage = together ? "av" : is_video ? "video" : "audio";
+  progress.video = is_video;
+  progress.audio = is_audio;
+  progress.sr = sr;
+  progress.fps = fps;
+  if (is_video) progress.frames_total = seq.event_count ? cues[seq.event_count - 1].frame : 0;
+  progress.samples_total = audio_frames;
+  if (is_audio) mixer.progress = &progress;
 
   for (int i = 0; i < seq.event_count; i++) {
     struct bm_event ev = seq.events[i];
-    int dt = ev.pos - (i ? seq.events[i-1].pos : 0);
-    time += dt * (60.0 / 48.0 / tempo);
 
     if (is_video) {
-      while (frames < time * fps - 1e-6) {
-        for (int p = 0; p < bw * bh; p++) {
-          uint8_t pix[3] = {0};
-          if (bg >= 0 && bitmaps[bg])
-            memcpy(pix, &bitmaps[bg][p*3], 3);
-          if (fg >= 0 && bitmaps[fg]) {
-            uint8_t *f = &bitmaps[fg][p*3];
-            if (f[0] || f[1] || f[2])
-              memcpy(pix, f, 3);
-          }
-          putchar(pix[0]);
-          putchar(pix[1]);
-          putchar(pix[2]);
-        }
-        frames++;
+      if (dirty && frames < cues[i].frame) {
+        compose_frame(frame, bg >= 0 ? bitmaps[bg] : NULL,
+          fg >= 0 ? bitmaps[fg] : NULL, bw, ow, oh, step);
+        if (y4m) rgb_to_yuv444(out_frame + 6, frame, (size_t)ow * oh);
+        dirty = 0;
+        fresh = 1;
       }
-    }
-
-    if (is_audio) {
-      int ns = (int)(time * sr - 1e-6) - samples;
-      if (ns > 0) {
-        int32_t *buf = calloc(ns * ch, sizeof(int32_t));
-        for (int w = 0; w < BM_INDEX_MAX; w++) {
-          if (waves[w].ptr < 0) continue;
-          for (int j = 0; j < ns && waves[w].ptr + j < waves[w].len; j++)
-            for (int c = 0; c < ch; c++)
-              buf[j*ch+c] += waves[w].pcm[(waves[w].ptr+j)*ch+c];
-          waves[w].ptr += ns;
-          if (waves[w].ptr >= waves[w].len) waves[w].ptr = -1;
+      while (frames < cues[i].frame) {
+        if (together) {
+          // Audio follows each frame as far as it can be mixed up to the
+          // frame's end without passing notes not yet started
+          long long upto = clock_index((frames + 1) / fps, sr);
+          mixer_run(&mixer, &voices, &bank, upto < cues[i].sample ? upto : cues[i].sample);
+        }
+        if (split.count && split.at[0] + 1 < split.count &&
+            frames == split.cuts[split.at[0] + 1]) {
+          split_next(&split, 0, &video, &bgv);
+          fresh = 1;
+        }
+        if (avi) {
+          avi_frame(avi, fresh ? frame : NULL);
+        } else if (use_bgv) {
+          bgv_frame(&bgv, !fresh ? NULL : y4m ? out_frame + 6 : frame);
+        } else {
+          sink_write(&video, out_frame, frame_bytes);
         }
-        for (int k = 0; k < ns*ch; k++) {
-          int32_t s = buf[k] >> 1;
-          if (s > INT16_MAX) s = INT16_MAX;
-          if (s < INT16_MIN) s = INT16_MIN;
-          putchar(s & 0xff);
-          putchar((s >> 8) & 0xff);
+        fresh = 0;
+        if (together && !avi) {
+          sink_push(&video);
+          sink_push(&sinks[0]);
         }
-        free(buf);
+        frames++;
+        progress.frames = frames;
+        progress_tick(&progress);
       }
-      samples += ns;
     }
 
-    if (ev.type == BM_TEMPO_CHANGE) tempo = ev.value_f;
-    else if (ev.type == BM_BGA_BASE_CHANGE) bg = ev.value;
-    else if (ev.type == BM_BGA_LAYER_CHANGE) fg = ev.value;
-    else if ((ev.type == BM_NOTE || ev.type == BM_NOTE_LONG) && is_audio)
-      waves[ev.value].ptr = 0;
+    if (is_audio && !parallel) mixer_run(&mixer, &voices, &bank, cues[i].sample);
+
+    if (ev.type == BM_BGA_BASE_CHANGE) {
+      bg = ev.value;
+      dirty = 1;
+    } else if (ev.type == BM_BGA_LAYER_CHANGE) {
+      fg = ev.value;
+      dirty = 1;
+    } else if ((ev.type == BM_NOTE || ev.type == BM_NOTE_LONG) && is_audio && !parallel) {
+      voice_start(&voices, &bank, &waves[ev.value],
+        (int)(cues[i].sample - mixer.samples), stem_bus(&stems, ev.track), NULL);
+    }
+    if (scenes_prefix && (ev.type == BM_BGA_BASE_CHANGE || ev.type == BM_BGA_LAYER_CHANGE))
+      scenes_show(&scenes, bg, fg, cues[i].frame);
+  }
+  if (is_video && !avi) {
+    if (use_bgv) bgv_close(&bgv);
+    if (!sink_finish(&video)) write_error = video.error;
+    // A reader taking both streams needs the end of video to reach it
+    // before the audio tail, which can be longer than a pipe holds
+    if (together && video.f && fclose(video.f) != 0 && !write_error) write_error = errno;
+  }
+  if (scenes_prefix) {
+    scenes_close(&scenes, seq.event_count ? cues[seq.event_count - 1].frame : 0);
+    fprintf(stderr, "Scenes: %d images for %lld scenes\n", scenes.count, scenes.listed);
   }
 
   if (is_audio) {
-    int active;
-    do {
-      active = 0;
-      for (int i = 0; i < BM_INDEX_MAX; i++)
-        if (waves[i].ptr >= 0) active = 1;
-
-      if (!active) break;
-
-      time += 1.0 / fps;
-
-      int ns = (int)(time * sr - 1e-6) - samples;
-      if (ns > 0) {
-        int32_t *buf = calloc(ns * ch, sizeof(int32_t));
-        for (int w = 0; w < BM_INDEX_MAX; w++) {
-          if (waves[w].ptr < 0) continue;
-          for (int j = 0; j < ns && waves[w].ptr + j < waves[w].len; j++)
-            for (int c = 0; c < ch; c++)
-              buf[j*ch+c] += waves[w].pcm[(waves[w].ptr+j)*ch+c];
-          waves[w].ptr += ns;
-          if (waves[w].ptr >= waves[w].len) waves[w].ptr = -1;
-        }
-        for (int k = 0; k < ns*ch; k++) {
-          int32_t s = buf[k] >> 1;
-          if (s > INT16_MAX) s = INT16_MAX;
-          if (s < INT16_MIN) s = INT16_MIN;
-          putchar(s & 0xff);
-          putchar((s >> 8) & 0xff);
-        }
-        free(buf);
-      }
-      samples += ns;
-    } while (active);
+    progress.stage = "audio";
+    if (parallel) {
+      int take_count;
+      struct take *takes = plan_takes(&seq, cues, waves, &stems,
+        &voices, &take_count);
+      long long last = 0;
+      for (int i = 0; i < take_count; i++)
+        if (last < takes[i].start + takes[i].stop) last = takes[i].start + takes[i].stop;
+      fprintf(stderr, "Rendering audio with %d jobs\n", jobs);
+      mixer.samples = audio_end(last_event, last, sr, fps);
+      render_parallel(takes, take_count, mixer.samples,
+        ch, sr, buses, sinks, jobs, mixer.headroom, &progress);
+      free(takes);
+    } else {
+      // A WAV header has already promised its length; bank mode only
+      // knows keysound lengths from the decoders until they are decoded
+      long long last = mixer.samples + voices_remaining(&voices);
+      mixer_finish(&mixer, &voices, &bank,
+        wav ? audio_frames : audio_end(last_event, last, sr, fps));
+    }
+    for (int b = 0; b < buses; b++)
+      if (!sink_finish(&sinks[b]) && !write_error) write_error = sinks[b].error;
+    for (int b = 1; b < buses; b++) wav_close(sinks[b].f, ch, sr);
+    if (avi) {
+      int error = avi_close(avi);
+      if (!write_error) write_error = error;
+    }
+    double took = ma_timer_get_time_in_seconds(&timer);
+    fprintf(stderr, "Audio rendered in %.2f s (%.0fx realtime)\n", took,
+      took > 0.0 ? mixer.samples / (double)sr / took : 0.0);
+    if (sinks[0].zeros > 0)
+      fprintf(stderr, "Silence: %.1f of %.1f s skipped without mixing\n",
+        sinks[0].zeros / (2.0 * ch * sr), mixer.samples / (double)sr);
+
+    if (report_path) {
+      if (meter_report(&meter, &voices, &headroom, report_path))
+        fprintf(stderr, "Loudness %.1f LUFS, true peak %.1f dBTP, %ld clipped samples, "
+          "mix peak %+.1f dBFS\n", meter_integrated(&meter),
+          20.0 * log10(meter.true_peak), headroom.clipped, headroom_db(headroom.peak));
+      else
+        fprintf(stderr, "Cannot write %s\n", report_path);
+    }
+
+    if (voices.stolen > 0)
+      fprintf(stderr, "Voices: %ld started, peak %d, %ld cut by the %d-voice "
+        "limit (%s first)\n", voices.started, voices.peak, voices.stolen,
+        voices.cap, steal_names[voices.policy]);
+
+    if (bank.enabled) {
+      long total = bank.hits + bank.misses;
+      fprintf(stderr, "Bank: %ld hits, %ld misses (%.1f%% hit rate), "
+        "%ld evictions, peak %.1f MB of %.1f MB\n",
+        bank.hits, bank.misses, total ? 100.0 * bank.hits / total : 100.0,
+        bank.evictions, bank.peak / 1048576.0, bank.cap / 1048576.0);
+    }
+
+    if (bank.packed_bytes > 0)
+      fprintf(stderr, "ADPCM: %.1f MB of keysounds held in %.1f MB, SNR %.1f dB "
+        "against s16 (worst keysound %.1f dB)\n", bank.pcm_bytes / 1048576.0,
+        bank.packed_bytes / 1048576.0,
+        bank.noise > 0.0 ? 10.0 * log10(bank.signal / bank.noise) : INFINITY,
+        bank.noise > 0.0 ? bank.worst_snr : INFINITY);
   }
 
+  if (split.count) {
+    if (is_audio) split.samples = mixer.samples;
+    split_close(&split);
+  }
+  if (writer) writer_stop(writer);
+  if (progress.f) {
+    progress.frames_total = progress.frames;
+    progress.samples_total = progress.samples;
+    progress_report(&progress, 1);
+  }
+  if (write_error) {
+    fprintf(stderr, "Output is incomplete: %s\n", strerror(write_error));
+    return 1;
+  }
   return 0;
 }
@@ -0,0 +1,155 @@
+// Expands repeat-aware video (.bgv) written by `bga_compo --bgv` back into
+// a frame stream: raw rgb24, or Y4M when the frames were stored as 4:4:4,
+// on standard output or into a file. The stream is what bga_compo would
+// have written with -v, so it can be piped straight into ffmpeg.
+//   bga_expand [-s <first frame>] [-n <frames>] <in.bgv> [out]
+// A seekable input is entered through its index at the first frame.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+uint32_t get_le(const uint8_t *p, int n)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < n; i++) v |= (uint32_t)p[i] << (i * 8);
+  return v;
+}
+
+long long get_le64(const uint8_t *p)
+{
+  return (long long)get_le(p, 4) | (long long)get_le(p + 4, 4) << 32;
+}
+
+int file_seek(FILE *f, long long off, int whence)
+{
+#ifdef _WIN32
+  return _fseeki64(f, off, whence);
+#else
+  return fseeko(f, (off_t)off, whence);
+#endif
+}
+
+// Moves to the last stored frame at or before `first` through the index;
+// returns its frame number, or -1 where the input cannot seek
+long long seek_index(FILE *f, long long first)
+{
+  uint8_t e[16];
+  if (file_seek(f, -12, SEEK_END) != 0 || fread(e, 1, 12, f) != 12 ||
+      memcmp(e + 8, "BGVE", 4) != 0)
+    return -1;
+  long long at = get_le64(e);
+  if (file_seek(f, at, SEEK_SET) != 0 || fread(e, 1, 16, f) != 16 ||
+      memcmp(e, "BGIX", 4) != 0)
+    return -1;
+  uint32_t count = get_le(e + 4, 4);
+  long long frame = 0, offset = 20;
+  for (uint32_t i = 0; i < count && fread(e, 1, 16, f) == 16; i++) {
+    if (get_le64(e) > first) break;
+    frame = get_le64(e);
+    offset = get_le64(e + 8);
+  }
+  if (file_seek(f, offset, SEEK_SET) != 0) return -1;
+  return frame;
+}
+
+int main(int argc, char *argv[])
+{
+  long long first = 0, limit = -1;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-' && argv[arg][1]; arg++) {
+    if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc) first = atoll(argv[++arg]);
+    else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) limit = atoll(argv[++arg]);
+    else { arg = argc; break; }
+  }
+  if (arg >= argc) {
+    fprintf(stderr, "Usage: %s [-s <first frame>] [-n <frames>] <in.bgv> [out]\n", argv[0]);
+    return 1;
+  }
+
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  FILE *in = strcmp(argv[arg], "-") == 0 ? stdin : fopen(argv[arg], "rb");
+  if (!in) {
+    fprintf(stderr, "Cannot open %s\n", argv[arg]);
+    return 1;
+  }
+  FILE *out = arg + 1 < argc ? fopen(argv[arg + 1], "wb") : stdout;
+  if (!out) {
+    fprintf(stderr, "Cannot write %s\n", argv[arg + 1]);
+    return 1;
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+  uint8_t head[20];
+  if (fread(head, 1, sizeof head, in) != sizeof head || memcmp(head, "BGAV", 4) != 0) {
+    fprintf(stderr, "%s is not a bga_compo video\n", argv[arg]);
+    return 1;
+  }
+  if (get_le(head + 4, 2) != 1) {
+    fprintf(stderr, "Unsupported version %u\n", get_le(head + 4, 2));
+    return 1;
+  }
+  int y4m = get_le(head + 6, 2) == 1;
+  uint32_t w = get_le(head + 8, 4), h = get_le(head + 12, 4);
+  size_t frame_size = (size_t)w * h * 3;
+  uint8_t *frame = malloc(frame_size);
+  if (!frame) return 1;
+  if (y4m)
+    fprintf(out, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444 XCOLORRANGE=LIMITED\n",
+      w, h, get_le(head + 16, 4));
+
+  long long at = 0;
+  if (first > 0) {
+    at = seek_index(in, first);
+    if (at < 0) {
+      // Not seekable: frames before the first are read and dropped
+      at = 0;
+      file_seek(in, sizeof head, SEEK_SET);
+    }
+  }
+
+  int stored = 0;
+  uint8_t tag[8];
+  while (limit != 0 && fread(tag, 1, 4, in) == 4) {
+    long long count;
+    if (memcmp(tag, "FRAM", 4) == 0) {
+      if (fread(frame, 1, frame_size, in) != frame_size) break;
+      stored = 1;
+      count = 1;
+    } else if (memcmp(tag, "REPT", 4) == 0 && stored) {
+      if (fread(tag + 4, 1, 4, in) != 4) break;
+      count = get_le(tag + 4, 4);
+    } else {
+      break;
+    }
+    if (at + count <= first) {
+      at += count;
+      continue;
+    }
+    if (at < first) {
+      count -= first - at;
+      at = first;
+    }
+    for (; count > 0 && limit != 0; count--) {
+      if (y4m) fwrite("FRAME\n", 1, 6, out);
+      if (fwrite(frame, 1, frame_size, out) != frame_size) return 1;
+      at++;
+      if (limit > 0) limit--;
+    }
+  }
+  if (memcmp(tag, "BGIX", 4) != 0 && limit != 0) {
+    fprintf(stderr, "%s is cut short after frame %lld\n", argv[arg], at);
+    return 1;
+  }
+  fclose(out);
+  return 0;
+}
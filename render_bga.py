@@ -4,12 +4,15 @@ from pathlib import Path
 import tempfile
 import shutil
 import time
+import wave
+import struct
 
 GREEN = "\033[92m"
 CYAN = "\033[96m"
 RESET = "\033[0m"
 
 BGA_COMPO_NAME = "bga_compo_clean.exe"
+BGA_EXPAND_NAME = "bga_expand.exe"
 
 
 def die(msg):
@@ -18,19 +21,6 @@ def die(msg):
     sys.exit(1)
 
 
-def ask_resolution():
-    s = input("Enter BMP width and height (press Enter for 256x256): ").strip()
-    if not s:
-        return 256, 256
-    try:
-        w, h = map(int, s.lower().replace("x", " ").split())
-        if w <= 0 or h <= 0:
-            raise ValueError
-        return w, h
-    except:
-        die("Invalid resolution format")
-
-
 def ask_mode():
     print("Select render mode:")
     print("1 - Lossless only")
@@ -61,6 +51,16 @@ def detect_encoder():
     return ("libx264", ["-preset", "medium", "-crf", "18"])
 
 
+def avi_duration_ms(path):
+    # Audio stream header of a bga_compo AVI: scale, rate and length
+    with open(path, "rb") as f:
+        head = f.read(65536)
+    i = head.find(b"auds")
+    scale, rate = struct.unpack_from("<II", head, i + 20)
+    length = struct.unpack_from("<I", head, i + 32)[0]
+    return int(length * scale * 1000 / rate)
+
+
 def draw_progress(pct):
     bar_len = 30
     filled = int(bar_len * pct / 100)
@@ -68,14 +68,53 @@ def draw_progress(pct):
     print(f"\r{CYAN}Progress:{RESET} [{bar}] {pct:3d}%", end="", flush=True)
 
 
-def run_ffmpeg_with_progress(cmd, total_ms, start_pct, end_pct):
+def advance_progress(last, pct):
+    for p in range(last + 1, pct + 1):
+        draw_progress(p)
+        time.sleep(0.003)
+    return max(last, pct)
+
+
+def run_compo_with_progress(cmd, log_path, start_pct, end_pct):
+    # bga_compo writes key=value progress records on stdout, its log on stderr
+    with open(log_path, "w") as log:
+        proc = subprocess.Popen(
+            [cmd[0], "--progress", "1", *cmd[1:]],
+            stdout=subprocess.PIPE,
+            stderr=log,
+            text=True,
+            bufsize=1
+        )
+        last = start_pct
+        record = {}
+        for line in proc.stdout:
+            key, _, value = line.strip().partition("=")
+            record[key] = value
+            if key != "progress":
+                continue
+            total = int(record.get("total_ms", "0"))
+            local = min(1.0, int(record.get("time_ms", "0")) / total) if total > 0 else 0.0
+            last = advance_progress(last, start_pct + int(local * (end_pct - start_pct)))
+        proc.wait()
+
+    if proc.returncode != 0:
+        print()
+        print(Path(log_path).read_text())
+        die("bga_compo failed")
+    last = advance_progress(last, end_pct)
+
+
+def run_ffmpeg_with_progress(cmd, total_ms, start_pct, end_pct, feed=None):
     proc = subprocess.Popen(
         cmd,
+        stdin=feed.stdout if feed else None,
         stdout=subprocess.PIPE,
         stderr=subprocess.DEVNULL,
         text=True,
         bufsize=1
     )
+    if feed:
+        feed.stdout.close()
 
     last = start_pct
 
@@ -83,30 +122,27 @@ def run_ffmpeg_with_progress(cmd, total_ms, start_pct, end_pct):
         if line.startswith("out_time_ms="):
             cur = int(line.split("=")[1])
             local = min(1.0, cur / total_ms)
-            pct = start_pct + int(local * (end_pct - start_pct))
-            if pct > last:
-                for p in range(last + 1, pct + 1):
-                    draw_progress(p)
-                    time.sleep(0.003)
-                last = pct
+            last = advance_progress(last, start_pct + int(local * (end_pct - start_pct)))
         elif line.startswith("progress=end"):
             break
 
     proc.wait()
 
-    if last < end_pct:
-        for p in range(last + 1, end_pct + 1):
-            draw_progress(p)
-            time.sleep(0.003)
+    advance_progress(last, end_pct)
 
     if proc.returncode != 0:
         die("ffmpeg failed")
+    if feed and feed.wait() != 0:
+        die("bga_expand failed")
 
 
-if len(sys.argv) < 2:
+args = [a for a in sys.argv[1:] if not a.startswith("--")]
+DRAFT = "--draft" in sys.argv[1:]
+
+if not args:
     die("Drag and drop a .bms/.bme file onto this executable")
 
-orig_bms_path = Path(sys.argv[1]).resolve()
+orig_bms_path = Path(args[0]).resolve()
 if not orig_bms_path.exists():
     die("Input file not found")
 
@@ -120,14 +156,20 @@ embedded_dir = Path(sys._MEIPASS) if hasattr(sys, "_MEIPASS") else exe_dir
 embedded_bga = embedded_dir / BGA_COMPO_NAME
 if not embedded_bga.exists():
     die(f"{BGA_COMPO_NAME} not found")
+embedded_expand = embedded_dir / BGA_EXPAND_NAME
 
 mode = ask_mode()
-WIDTH, HEIGHT = ask_resolution()
 
-lossless_out = output_dir / "out.avi"
-web_out = output_dir / "out.mp4"
+suffix = "_draft" if DRAFT else ""
+
+lossless_out = output_dir / f"out{suffix}.avi"
+web_out = output_dir / f"out{suffix}.mp4"
 
 vcodec, vcodec_opts = detect_encoder()
+if DRAFT and vcodec == "libx264":
+    vcodec_opts = ["-preset", "ultrafast", "-crf", "28"]
+
+compo_opts = ["--draft"] if DRAFT else []
 
 with tempfile.TemporaryDirectory(prefix="bga_tmp_") as tmp:
     tmp = Path(tmp)
@@ -140,55 +182,38 @@ with tempfile.TemporaryDirectory(prefix="bga_tmp_") as tmp:
     bga_compo = tmp / BGA_COMPO_NAME
     shutil.copyfile(embedded_bga, bga_compo)
 
-    video_raw = tmp / "video.rgb"
-    audio_raw = tmp / "audio.pcm"
+    # Repeated frames are stored once and expanded on the way into ffmpeg
+    video_bgv = tmp / "video.bgv"
+    audio_wav = tmp / "audio.wav"
 
-    with open(video_raw, "wb") as f:
-        subprocess.run([str(bga_compo), "-v", str(bms_tmp)], stdout=f, check=True)
+    compo_log = tmp / "bga_compo.log"
+    compo_end = 100 if mode == "1" else 50
 
-    with open(audio_raw, "wb") as f:
-        subprocess.run([str(bga_compo), "-a", str(bms_tmp)], stdout=f, check=True)
+    draw_progress(0)
 
-    total_ms = int((audio_raw.stat().st_size / (44100 * 2 * 2)) * 1000)
+    # The lossless master is written by bga_compo itself in one pass
+    if mode in ("1", "3"):
+        run_compo_with_progress([str(bga_compo), "--avi", *compo_opts, "-o", str(lossless_out), str(bms_tmp)], compo_log, 0, compo_end)
+        total_ms = avi_duration_ms(lossless_out)
 
-    draw_progress(0)
+    if mode == "2":
+        if not embedded_expand.exists():
+            die(f"{BGA_EXPAND_NAME} not found")
+        run_compo_with_progress([str(bga_compo), "--bgv", "--y4m", "--wav", *compo_opts, "--av", str(video_bgv), str(audio_wav), str(bms_tmp)], compo_log, 0, compo_end)
+        with wave.open(str(audio_wav)) as w:
+            total_ms = int(w.getnframes() * 1000 / w.getframerate())
 
     if mode == "1":
-        run_ffmpeg_with_progress(
-            [
-                "ffmpeg", "-y",
-                "-f", "rawvideo",
-                "-pixel_format", "rgb24",
-                "-video_size", f"{WIDTH}x{HEIGHT}",
-                "-framerate", "30",
-                "-i", str(video_raw),
-                "-f", "s16le",
-                "-ar", "44100",
-                "-ac", "2",
-                "-i", str(audio_raw),
-                "-c:v", "huffyuv",
-                "-c:a", "pcm_s16le",
-                "-progress", "pipe:1",
-                "-nostats",
-                str(lossless_out)
-            ],
-            total_ms, 0, 100
-        )
         print(f"\n{GREEN}Created:{RESET} {lossless_out}")
 
     if mode == "2":
+        expand = subprocess.Popen([str(embedded_expand), str(video_bgv)], stdout=subprocess.PIPE)
         run_ffmpeg_with_progress(
             [
                 "ffmpeg", "-y",
-                "-f", "rawvideo",
-                "-pixel_format", "rgb24",
-                "-video_size", f"{WIDTH}x{HEIGHT}",
-                "-framerate", "30",
-                "-i", str(video_raw),
-                "-f", "s16le",
-                "-ar", "44100",
-                "-ac", "2",
-                "-i", str(audio_raw),
+                "-f", "yuv4mpegpipe",
+                "-i", "pipe:0",
+                "-i", str(audio_wav),
                 "-c:v", vcodec,
                 *vcodec_opts,
                 "-pix_fmt", "yuv420p",
@@ -199,32 +224,11 @@ with tempfile.TemporaryDirectory(prefix="bga_tmp_") as tmp:
                 "-nostats",
                 str(web_out)
             ],
-            total_ms, 0, 100
+            total_ms, compo_end, 100, expand
         )
         print(f"\n{GREEN}Created:{RESET} {web_out}")
 
     if mode == "3":
-        run_ffmpeg_with_progress(
-            [
-                "ffmpeg", "-y",
-                "-f", "rawvideo",
-                "-pixel_format", "rgb24",
-                "-video_size", f"{WIDTH}x{HEIGHT}",
-                "-framerate", "30",
-                "-i", str(video_raw),
-                "-f", "s16le",
-                "-ar", "44100",
-                "-ac", "2",
-                "-i", str(audio_raw),
-                "-c:v", "huffyuv",
-                "-c:a", "pcm_s16le",
-                "-progress", "pipe:1",
-                "-nostats",
-                str(lossless_out)
-            ],
-            total_ms, 0, 50
-        )
-
         run_ffmpeg_with_progress(
             [
                 "ffmpeg", "-y",
@@ -239,7 +243,7 @@ with tempfile.TemporaryDirectory(prefix="bga_tmp_") as tmp:
                 "-nostats",
                 str(web_out)
             ],
-            total_ms, 50, 100
+            total_ms, compo_end, 100
         )
 
         print(f"\n{GREEN}Created:{RESET} {lossless_out}")